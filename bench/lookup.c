@@ -0,0 +1,144 @@
+/*
+ * Lookup latency versus node count, on paths shaped like /botNNNN/botMMMM:
+ *
+ *   find_node     the path resolved one component at a time, first in
+ *                 the bot index and then in the bot's own directory
+ *   keys strcmp   the same descents comparing the names with strcmp only
+ *
+ * then the rate of creating conversations from 1 to 8 threads, each for
+ * its own bot /tNNN with the bots /pNNNNN: a create locks only the two
+ * bots' directories and reads the bot index.
+ *
+ * Compile with:
+ * gcc -Wall -Wno-unused -O2 bench/lookup.c rbtree/rbtree.c `pkg-config fuse3 --cflags --libs` -o lookup
+ */
+#define DAIDAI_NO_MAIN
+#include "../daidai.c"
+
+#include <time.h>
+
+#define LOOKUPS 1000000
+#define CREATES 50000
+
+static struct daidai_node *find_child_strcmp(struct daidai_node *dir, const char *name) {
+    struct rb_node *node = dir->children.rb_node;
+
+    while (node) {
+        struct daidai_node *data = child_of(node);
+        int result = strcmp(name, data->name);
+
+        if (result < 0)
+            node = node->rb_left;
+        else if (result > 0)
+            node = node->rb_right;
+        else
+            return data;
+    }
+    return NULL;
+}
+
+/* find_node without the keys, paths are always /botNNNN/botMMMM */
+static struct daidai_node *walk_strcmp(const char *path) {
+    char name[8];
+
+    memcpy(name, path + 1, 6);
+    name[6] = '\0';
+    struct daidai_node *dir = find_child_strcmp(root_node, name);
+    return dir ? find_child_strcmp(dir, path + 8) : NULL;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void node_path(char *buf, size_t i) {
+    sprintf(buf, "/bot%03zu/bot%03zu", i / 1000, i % 1000);
+}
+
+#define TIME(ns, expr)                                      \
+    do {                                                    \
+        double start = now();                               \
+        for (size_t i = 0; i < LOOKUPS; i++)                \
+            found += (expr) != NULL;                        \
+        ns = (now() - start) * 1e9 / LOOKUPS;               \
+    } while (0)
+
+static struct daidai_node *bench_dir(const char *fmt, long i) {
+    struct daidai_node *node = NULL;
+    char path[32];
+
+    sprintf(path, fmt, i);
+    pthread_rwlock_wrlock(root_node->lock);
+    make_dir(root_node, path, &node);
+    pthread_rwlock_unlock(root_node->lock);
+    return node;
+}
+
+static void *creator(void *arg) {
+    struct daidai_node *dir = bench_dir("/t%03ld", (long) arg);
+    struct fuse_entry_param e;
+    struct daidai_node *node;
+    uint64_t lsn = 0;
+    char name[32];
+
+    for (long i = 0; i < CREATES; i++) {
+        sprintf(name, "p%05ld", i);
+        if (make_entry(ino_of(dir), name, &lsn, &e, &node) == 0)
+            forget_node(node, 1);
+    }
+    return NULL;
+}
+
+int main(void) {
+    static const size_t sizes[] = {10000, 100000, 1000000};
+    char (*keys)[32] = malloc(LOOKUPS * sizeof(*keys));
+    size_t nr_nodes = 0;
+
+    root_node = create_node(Directory, "/", NULL);
+
+    printf("%10s %14s %14s\n", "nodes", "find_node", "keys strcmp");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        char path[32];
+        struct daidai_node *dir = NULL;
+        for (; nr_nodes < sizes[s]; nr_nodes++) {
+            node_path(path, nr_nodes);
+            if (nr_nodes % 1000 == 0) {
+                path[7] = '\0';
+                make_dir(root_node, path, &dir);
+                node_path(path, nr_nodes);
+            }
+            insert_node(dir, create_node(File, path, NULL));
+        }
+
+        srand(1);
+        for (size_t i = 0; i < LOOKUPS; i++)
+            node_path(keys[i], (size_t) rand() % nr_nodes);
+
+        size_t found = 0;
+        double walk_ns, strcmp_ns;
+        TIME(walk_ns, find_node(keys[i]));
+        TIME(strcmp_ns, walk_strcmp(keys[i]));
+
+        assert(found == 2 * LOOKUPS);
+        printf("%10zu %14.1f %14.1f\n", nr_nodes, walk_ns, strcmp_ns);
+    }
+
+    for (long i = 0; i < CREATES; i++)
+        bench_dir("/p%05ld", i);
+    printf("\n%10s %14s\n", "threads", "creates/s");
+    for (long nr_threads = 1, next = 0; nr_threads <= 8; nr_threads *= 2) {
+        pthread_t threads[8];
+        double start = now();
+        for (long i = 0; i < nr_threads; i++)
+            pthread_create(&threads[i], NULL, creator, (void *) (next + i));
+        for (long i = 0; i < nr_threads; i++)
+            pthread_join(threads[i], NULL);
+        printf("%10ld %14.0f\n", nr_threads, nr_threads * CREATES / (now() - start));
+        next += nr_threads;
+    }
+
+    free(keys);
+    return 0;
+}
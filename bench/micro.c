@@ -0,0 +1,126 @@
+/*
+ * The data structures without a mount, in ns per call:
+ *
+ *   insert_node   create_node and insert_node of /botNNNN/botMMMM, 1000
+ *                 conversations per bot
+ *   find_node     random lookups of those paths
+ *   reverse_path  the same paths turned around
+ *   write_file    appends of one message to a conversation, by size, then
+ *                 by the number of threads appending to one conversation
+ *
+ * Compile with:
+ * gcc -Wall -Wno-unused -O2 bench/micro.c rbtree/rbtree.c `pkg-config fuse3 --cflags --libs` -o micro
+ */
+#define DAIDAI_NO_MAIN
+#include "../daidai.c"
+
+#define NODES 1000000
+#define LOOKUPS 1000000
+#define WRITE_BYTES (256 << 20)     /* per size, the conversation is dropped after */
+#define WRITES_MAX 1000000
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void node_path(char *buf, size_t i) {
+    sprintf(buf, "/bot%04zu/bot%04zu", i / 1000, i % 1000);
+}
+
+static void write_msg(struct conversation *conv, const char *msg, size_t size) {
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+    bufv.buf[0].mem = (void *) msg;
+    int res = write_file(conv, &bufv);
+    assert(res == 0);
+}
+
+struct appender {
+    pthread_t thread;
+    struct conversation *conv;
+    size_t count;
+};
+
+static void *append(void *arg) {
+    struct appender *a = arg;
+    char msg[64];
+
+    memset(msg, 'x', sizeof(msg));
+    for (size_t i = 0; i < a->count; i++)
+        write_msg(a->conv, msg, sizeof(msg));
+    return NULL;
+}
+
+int main(void) {
+    char (*keys)[32] = malloc(LOOKUPS * sizeof(*keys));
+    char path[32], reversed[32];
+    struct daidai_node *dir = NULL;
+    size_t found = 0;
+    double start;
+
+    root_node = create_node(Directory, "/", NULL);
+
+    start = now();
+    for (size_t i = 0; i < NODES; i++) {
+        node_path(path, i);
+        if (i % 1000 == 0) {
+            path[8] = '\0';
+            make_dir(root_node, path, &dir);
+            node_path(path, i);
+        }
+        insert_node(dir, create_node(File, path, NULL));
+    }
+    printf("%-14s %10.1f\n", "insert_node", (now() - start) * 1e9 / NODES);
+
+    srand(1);
+    for (size_t i = 0; i < LOOKUPS; i++)
+        node_path(keys[i], (size_t) rand() % NODES);
+    start = now();
+    for (size_t i = 0; i < LOOKUPS; i++)
+        found += find_node(keys[i]) != NULL;
+    printf("%-14s %10.1f\n", "find_node", (now() - start) * 1e9 / LOOKUPS);
+    assert(found == LOOKUPS);
+
+    start = now();
+    for (size_t i = 0; i < LOOKUPS; i++)
+        found += reverse_path(keys[i], reversed, sizeof(reversed)) == 0;
+    printf("%-14s %10.1f\n", "reverse_path", (now() - start) * 1e9 / LOOKUPS);
+    assert(found == 2 * LOOKUPS);
+
+    static const size_t sizes[] = {16, 256, 4096, 65536};
+    char *msg = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+    memset(msg, 'x', sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+    printf("\n%-14s %10s %10s %10s\n", "write_file", "size", "ns", "MB/s");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        struct conversation *conv = create_conv();
+        size_t count = WRITE_BYTES / sizes[s] < WRITES_MAX ? WRITE_BYTES / sizes[s] : WRITES_MAX;
+        start = now();
+        for (size_t i = 0; i < count; i++)
+            write_msg(conv, msg, sizes[s]);
+        double secs = now() - start;
+        printf("%-14s %10zu %10.1f %10.0f\n", "", sizes[s], secs * 1e9 / count,
+               count * sizes[s] / secs / 1e6);
+        put_conv(conv);
+    }
+
+    printf("\n%-14s %10s %10s\n", "write_file", "threads", "writes/s");
+    for (int nr_threads = 1; nr_threads <= 8; nr_threads *= 2) {
+        struct appender appenders[8];
+        struct conversation *conv = create_conv();
+        start = now();
+        for (int i = 0; i < nr_threads; i++) {
+            appenders[i].conv = conv;
+            appenders[i].count = WRITES_MAX / nr_threads;
+            pthread_create(&appenders[i].thread, NULL, append, &appenders[i]);
+        }
+        for (int i = 0; i < nr_threads; i++)
+            pthread_join(appenders[i].thread, NULL);
+        printf("%-14s %10d %10.0f\n", "", nr_threads, WRITES_MAX / nr_threads * nr_threads / (now() - start));
+        put_conv(conv);
+    }
+
+    free(msg);
+    free(keys);
+    return 0;
+}
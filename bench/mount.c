@@ -0,0 +1,343 @@
+/*
+ * Operation throughput and latency through the kernel: daidai is started
+ * on a fresh mountpoint (or -m names one already mounted), the bots and
+ * their conversations are made, and then:
+ *
+ *   write/read    threads picking a random conversation for each
+ *                 operation, reading a message at a random offset of
+ *                 what was written at setup or appending one
+ *   create        the entries of one large directory
+ *   readdir       listings of that directory
+ *
+ * Options:
+ *
+ *   -b N      bots (16)
+ *   -c N      conversations of each bot with the next N bots (4)
+ *   -s N      message size in bytes (64)
+ *   -r N      percentage of operations that are reads (50)
+ *   -t N      threads (4)
+ *   -n N      operations per thread (100000)
+ *   -d N      entries in the large directory, 0 skips it (10000)
+ *   -o OPTS   options for daidai
+ *   -m DIR    use the filesystem mounted on DIR instead
+ *
+ * Compile with:
+ * gcc -Wall -O2 bench/mount.c -lpthread -o mount
+ * and run as ./mount [options] ./daidai
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define PREFILL 16                  /* messages in each conversation before the run */
+#define LISTINGS 20
+
+static struct {
+    int bots, convs, size, reads, threads, ops, dirents;
+    const char *daidai_opts;
+    const char *mnt;
+} cfg = {16, 4, 64, 50, 4, 100000, 10000, NULL, NULL};
+
+static int nr_convs;
+
+struct samples {
+    uint64_t *ns;
+    size_t nr;
+};
+
+struct worker {
+    pthread_t thread;
+    int id;
+    struct samples reads, writes;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void die(const char *what) {
+    perror(what);
+    exit(1);
+}
+
+/* bot i's end of its j-th conversation */
+static void conv_path(char *buf, int i, int j) {
+    snprintf(buf, PATH_MAX, "%s/bot%04d/bot%04d", cfg.mnt, i, (i + 1 + j) % cfg.bots);
+}
+
+static int cmp_ns(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *op, struct samples *s, double secs) {
+    if (s->nr == 0)
+        return;
+    qsort(s->ns, s->nr, sizeof(uint64_t), cmp_ns);
+    printf("%-10s %10zu %12.0f %10.1f %10.1f\n", op, s->nr, s->nr / secs,
+           s->ns[s->nr / 2] / 1e3, s->ns[s->nr * 99 / 100] / 1e3);
+}
+
+/* the workers' samples of one kind, in one array */
+static struct samples merge(struct worker *workers, int reads) {
+    struct samples all = {NULL, 0};
+    for (int i = 0; i < cfg.threads; i++)
+        all.nr += reads ? workers[i].reads.nr : workers[i].writes.nr;
+    all.ns = malloc((all.nr ? all.nr : 1) * sizeof(uint64_t));
+    if (all.ns == NULL)
+        die("malloc");
+
+    size_t pos = 0;
+    for (int i = 0; i < cfg.threads; i++) {
+        struct samples *s = reads ? &workers[i].reads : &workers[i].writes;
+        memcpy(all.ns + pos, s->ns, s->nr * sizeof(uint64_t));
+        pos += s->nr;
+    }
+    return all;
+}
+
+static void *work(void *arg) {
+    struct worker *w = arg;
+    char *msg = malloc(cfg.size);
+    unsigned int seed = w->id + 1;
+    char path[PATH_MAX];
+
+    int *fds = malloc(nr_convs * sizeof(int));
+    if (msg == NULL || fds == NULL)
+        die("malloc");
+    memset(msg, 'a' + w->id % 26, cfg.size);
+    for (int k = 0; k < nr_convs; k++) {
+        conv_path(path, k / cfg.convs, k % cfg.convs);
+        if ((fds[k] = open(path, O_RDWR | O_APPEND)) < 0)
+            die(path);
+    }
+
+    for (int n = 0; n < cfg.ops; n++) {
+        int fd = fds[rand_r(&seed) % nr_convs];
+        int read_op = (int) (rand_r(&seed) % 100) < cfg.reads;
+        uint64_t start = now_ns();
+        ssize_t res;
+        if (read_op)
+            res = pread(fd, msg, cfg.size, (off_t) (rand_r(&seed) % PREFILL) * cfg.size);
+        else
+            res = write(fd, msg, cfg.size);
+        uint64_t ns = now_ns() - start;
+        if (res != cfg.size)
+            die(read_op ? "read" : "write");
+
+        struct samples *s = read_op ? &w->reads : &w->writes;
+        s->ns[s->nr++] = ns;
+    }
+
+    for (int k = 0; k < nr_convs; k++)
+        close(fds[k]);
+    free(fds);
+    free(msg);
+    return NULL;
+}
+
+static void setup(void) {
+    char path[PATH_MAX];
+    char *msg = malloc(cfg.size);
+    if (msg == NULL)
+        die("malloc");
+    memset(msg, '-', cfg.size);
+
+    for (int i = 0; i < cfg.bots; i++) {
+        snprintf(path, sizeof(path), "%s/bot%04d", cfg.mnt, i);
+        if (mkdir(path, 0755) != 0 && errno != EEXIST)
+            die(path);
+    }
+    /* one end is enough, the other appears with it */
+    for (int i = 0; i < cfg.bots; i++)
+        for (int j = 0; j < cfg.convs; j++) {
+            conv_path(path, i, j);
+            int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+            if (fd < 0)
+                die(path);
+            for (int k = 0; k < PREFILL; k++)
+                if (write(fd, msg, cfg.size) != cfg.size)
+                    die(path);
+            close(fd);
+        }
+    free(msg);
+}
+
+static void bench_dir(void) {
+    char path[PATH_MAX];
+    struct samples s = {malloc((cfg.dirents > LISTINGS ? cfg.dirents : LISTINGS) * sizeof(uint64_t)), 0};
+    if (s.ns == NULL)
+        die("malloc");
+
+    snprintf(path, sizeof(path), "%s/big", cfg.mnt);
+    if (mkdir(path, 0755) != 0 && errno != EEXIST)
+        die(path);
+    uint64_t begin = now_ns();
+    for (int i = 0; i < cfg.dirents; i++) {
+        snprintf(path, sizeof(path), "%s/big/p%06d", cfg.mnt, i);
+        uint64_t start = now_ns();
+        int fd = open(path, O_WRONLY | O_CREAT, 0644);
+        if (fd < 0)
+            die(path);
+        close(fd);
+        s.ns[s.nr++] = now_ns() - start;
+    }
+    report("create", &s, (now_ns() - begin) / 1e9);
+
+    snprintf(path, sizeof(path), "%s/big", cfg.mnt);
+    s.nr = 0;
+    begin = now_ns();
+    for (int n = 0; n < LISTINGS; n++) {
+        uint64_t start = now_ns();
+        DIR *dir = opendir(path);
+        if (dir == NULL)
+            die(path);
+        int entries = 0;
+        while (readdir(dir) != NULL)
+            entries++;
+        closedir(dir);
+        s.ns[s.nr++] = now_ns() - start;
+        if (entries < cfg.dirents)
+            fprintf(stderr, "readdir: %d of %d entries\n", entries, cfg.dirents);
+    }
+    report("readdir", &s, (now_ns() - begin) / 1e9);
+    printf("%-10s %10d entries per listing\n", "", cfg.dirents + 2);
+    free(s.ns);
+}
+
+/* start daidai on mnt and wait for the mount to show */
+static pid_t mount_daidai(const char *daidai) {
+    struct stat parent, st;
+    char up[PATH_MAX];
+
+    snprintf(up, sizeof(up), "%s/..", cfg.mnt);
+    if (stat(up, &parent) != 0)
+        die(up);
+
+    pid_t pid = fork();
+    if (pid < 0)
+        die("fork");
+    if (pid == 0) {
+        if (cfg.daidai_opts != NULL)
+            execl(daidai, daidai, "-f", "-o", cfg.daidai_opts, cfg.mnt, (char *) NULL);
+        else
+            execl(daidai, daidai, "-f", cfg.mnt, (char *) NULL);
+        die(daidai);
+    }
+
+    for (int tries = 0; tries < 1000; tries++) {
+        if (stat(cfg.mnt, &st) == 0 && st.st_dev != parent.st_dev)
+            return pid;
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            fprintf(stderr, "%s exited before mounting\n", daidai);
+            exit(1);
+        }
+        usleep(10000);
+    }
+    fprintf(stderr, "%s did not mount %s\n", daidai, cfg.mnt);
+    kill(pid, SIGTERM);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "b:c:s:r:t:n:d:o:m:")) != -1) {
+        switch (opt) {
+        case 'b': cfg.bots = atoi(optarg); break;
+        case 'c': cfg.convs = atoi(optarg); break;
+        case 's': cfg.size = atoi(optarg); break;
+        case 'r': cfg.reads = atoi(optarg); break;
+        case 't': cfg.threads = atoi(optarg); break;
+        case 'n': cfg.ops = atoi(optarg); break;
+        case 'd': cfg.dirents = atoi(optarg); break;
+        case 'o': cfg.daidai_opts = optarg; break;
+        case 'm': cfg.mnt = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-b bots] [-c convs] [-s size] [-r read%%] [-t threads] "
+                            "[-n ops] [-d dirents] [-o opts] (-m mountpoint | daidai)\n", argv[0]);
+            return 1;
+        }
+    }
+    if (cfg.bots < 2 || cfg.convs < 1 || cfg.convs >= cfg.bots || cfg.size < 1 ||
+        cfg.threads < 1 || cfg.ops < 0 || cfg.dirents < 0) {
+        fprintf(stderr, "%s: need 1 <= convs < bots, size >= 1 and threads >= 1\n", argv[0]);
+        return 1;
+    }
+
+    pid_t pid = 0;
+    char tmp[] = "/tmp/daidai-bench.XXXXXX";
+    if (cfg.mnt == NULL) {
+        if (optind >= argc) {
+            fprintf(stderr, "%s: no daidai binary given\n", argv[0]);
+            return 1;
+        }
+        if (mkdtemp(tmp) == NULL)
+            die("mkdtemp");
+        cfg.mnt = tmp;
+        pid = mount_daidai(argv[optind]);
+    }
+
+    nr_convs = cfg.bots * cfg.convs;
+    setup();
+    printf("%d bots, %d conversations, %d byte messages, %d%% reads, %d threads\n\n",
+           cfg.bots, nr_convs, cfg.size, cfg.reads, cfg.threads);
+    printf("%-10s %10s %12s %10s %10s\n", "op", "count", "ops/s", "p50 us", "p99 us");
+
+    struct worker *workers = calloc(cfg.threads, sizeof(struct worker));
+    if (workers == NULL)
+        die("calloc");
+    for (int i = 0; i < cfg.threads; i++) {
+        workers[i].id = i;
+        workers[i].reads.ns = malloc((cfg.ops ? cfg.ops : 1) * sizeof(uint64_t));
+        workers[i].writes.ns = malloc((cfg.ops ? cfg.ops : 1) * sizeof(uint64_t));
+        if (workers[i].reads.ns == NULL || workers[i].writes.ns == NULL)
+            die("malloc");
+    }
+    uint64_t begin = now_ns();
+    for (int i = 0; i < cfg.threads; i++)
+        if ((errno = pthread_create(&workers[i].thread, NULL, work, &workers[i])) != 0)
+            die("pthread_create");
+    for (int i = 0; i < cfg.threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    double secs = (now_ns() - begin) / 1e9;
+
+    /* each kind's rate is over the whole run, they add up to the total */
+    struct samples writes = merge(workers, 0), reads = merge(workers, 1);
+    report("write", &writes, secs);
+    report("read", &reads, secs);
+    printf("%-10s %10zu %12.0f\n", "total", reads.nr + writes.nr, (reads.nr + writes.nr) / secs);
+    free(writes.ns);
+    free(reads.ns);
+    for (int i = 0; i < cfg.threads; i++) {
+        free(workers[i].reads.ns);
+        free(workers[i].writes.ns);
+    }
+    free(workers);
+
+    if (cfg.dirents > 0) {
+        printf("\n");
+        bench_dir();
+    }
+
+    if (pid > 0) {
+        /* daidai unmounts on SIGTERM */
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        rmdir(tmp);
+    }
+    return 0;
+}
@@ -1,12 +1,29 @@
 #define FUSE_USE_VERSION 31
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <assert.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <linux/falloc.h>
 #include "rbtree/rbtree.h"
 
 
@@ -15,496 +32,5537 @@
  * gcc -Wall daidai.c rbtree/rbtree.c `pkg-config fuse3 --cflags --libs` -o daidai
  */
 
-#define debug
 
+/*
+ * Message storage: fixed-size chunks drawn from a pool. Bytes never move
+ * once written, growing a conversation only appends chunks.
+ */
+#define CHUNK_SIZE (64 * 1024)
+#define CHUNK_POOL_MAX 64
+
+struct chunk {
+    struct chunk *next;
+    char data[CHUNK_SIZE];
+};
+
+/* how much of a conversation is kept, 0 for no limit */
+struct retention {
+    uint64_t size;                  /* bytes */
+    uint64_t messages;              /* needs -o framed */
+    uint64_t age;                   /* seconds */
+};
+
+/*
+ * A conversation holds the messages of one bot pair. Both /a/b and /b/a
+ * point to the same conversation, so a message is stored only once.
+ * Offsets count every byte ever written; retention (see below) drops
+ * whole chunks from the front and moves start, so chunks[i] holds the
+ * bytes [start + i * CHUNK_SIZE, start + (i + 1) * CHUNK_SIZE).
+ *
+ * lock guards chunks, size, ends and waiters; the refcount is atomic so readers
+ * can pin a conversation and drop the directory locks before touching
+ * the data.
+ *
+ * A conversation loaded from a snapshot starts with every chunks[i] NULL:
+ * those bytes are read straight from the mapped image at base and only
+ * copied into a chunk when they are overwritten.
+ */
+struct conversation {
+    pthread_rwlock_t lock;
+    struct chunk **chunks;
+    time_t *stamps;                 /* when each chunk was last appended to */
+    const char *base;               /* snapshot image from start, or NULL */
+    size_t base_size;
+    size_t nr_chunks;
+    size_t max_chunks;
+    size_t start;                   /* the first byte kept, a multiple of CHUNK_SIZE */
+    size_t size;                    /* written under lock, read atomically by appends */
+    size_t tail;                    /* claimed by appends, size up to tail is in flight */
+    int refcount;
+    struct daidai_node *ends;       /* nodes sharing it, under lock */
+    int shard;                      /* the node with the other end, -1 for this one; set once */
+    struct waiter *waiters;         /* polls and reads waiting for a write, under lock */
+
+    int inval_pending;              /* queued for kernel cache invalidation */
+    struct conversation *inval_next;
+
+    uint64_t snap_gen;              /* compaction only: snap_id is valid */
+    size_t snap_id;
+    uint64_t snap_marks;            /* compaction only: dropped_marks when laid out */
+
+    /* eviction (-o max_memory), under lock except where noted */
+    size_t nr_resident;             /* chunks[] that are not NULL */
+    int referenced;                 /* CLOCK bit, atomic */
+    struct conversation *clock_prev, *clock_next;   /* under evict.lock */
+    off_t spill_off;                /* slot in the spill file */
+    size_t spill_cap;               /* 0 when there is none */
+
+    /* framing (-o framed): where each message ends, under lock */
+    const uint64_t *base_marks;     /* the first ones, in the snapshot image */
+    size_t nr_base_marks;
+    uint64_t *marks;                /* from first_mark on, the ones before were dropped */
+    size_t first_mark;
+    size_t nr_marks;
+    size_t max_marks;
+    uint64_t dropped_marks;         /* ever, so a snapshot can tell which are gone */
+
+    struct retention retain;        /* its own limits, under lock */
+};
 
 /*
  * Data structure: rbtree
  * reference: https://www.kernel.org/doc/Documentation/rbtree.txt
+ *
+ * There is no global index: every directory keeps its entries in its own
+ * tree keyed by name, the root's tree being the index of bots, so a path
+ * is resolved with one small descent per component. Each tree link sits
+ * next to the first 8 bytes of the name (see key_cmp), and nodes come
+ * 64-byte aligned from the slabs with everything lookup and readdir touch
+ * in the first cache line.
+ *
+ * refs counts the kernel's lookups plus one while the node is linked into
+ * a directory or the limbo; whoever drops it to zero frees the node.
  */
 struct daidai_node {
+    uint64_t name_key;              /* make_key(name) */
+    struct rb_node child_node;      /* entry in parent->children or limbo */
+    const char *name;               /* basename, points into path */
     int type;
-    char *path;
-    void *content;
-    size_t capacity;
-    struct rb_node rb_node;
+    int unlinked;                   /* erased, under the parent's lock */
+    struct rb_root children;        /* directories only, keyed by name */
+    pthread_rwlock_t *lock;         /* directories only, guards children */
+
+    struct conversation *conv;
+    struct daidai_node *parent;
+    struct daidai_node *conv_next;  /* next in conv->ends, or in the reclaim queue */
+    const struct vfile_ops *vops;   /* Virtual only */
+    uint64_t refs;                  /* atomic */
+    char path[];                    /* inline, see node_size() */
 };
 
+#define node_size(len) (sizeof(struct daidai_node) + (len) + 1)
+
 #define Directory 0
 #define File 1
+#define Virtual 2
 
-static struct rb_root rb_root = RB_ROOT;
+/*
+ * Virtual files have no conversation: their text is rendered when they
+ * are opened into a vfile_buf owned by the file handle, which read serves
+ * and release frees. They report size 0 and are opened with direct_io.
+ * write may replace the buffer, to show what it did on the next read; a
+ * stream file's reads ignore the offset and return each byte once.
+ */
+struct vfile_buf {
+    const struct vfile_ops *ops;
+    void *priv;                     /* per-handle state, freed with the buffer */
+    size_t read;                    /* stream files: bytes already returned */
+    size_t size;
+    char data[];
+};
 
-static int free_node(struct daidai_node *data) {
-    if (data->path != NULL)
-        free(data->path);
-    if (data->content != NULL)
-        free(data->content);
-    free(data);
+struct vfile_ops {
+    struct vfile_buf *(*render)(void);
+    int (*write)(struct vfile_buf **vbuf, const char *buf, size_t size);
+    int stream;
+};
 
-    return 0;
-}
+/*
+ * Directory handle: remembers where the last readdir stopped, so the next
+ * call resumes with one tree search instead of skipping offset entries.
+ */
+struct dir_cursor {
+    off_t offset;
+    char name[NAME_MAX + 1];
+};
 
-static struct daidai_node *create_node(int type, const char *path) {
-    struct daidai_node *node = malloc(sizeof(struct daidai_node));
-    memset(node, 0, sizeof(struct daidai_node));
+/*
+ * fi->fh of everything opened, so the data path never looks a path up
+ * again. A File handle pins its conversation, which keeps the content
+ * alive if the file is unlinked while it is still open.
+ */
+struct file_handle {
+    int type;
+    int view;                       /* File: INBOX or TAIL, see view_of() */
+    pthread_mutex_t lock;           /* Virtual: write and read of vbuf */
+    union {
+        struct {                    /* File */
+            struct conversation *conv;
+            size_t seen;            /* end of the last read, atomic */
+            struct waiter *poll;    /* queued poll, under conv->lock */
+            size_t from, to;        /* TAIL: the messages shown */
+        };
+        struct vfile_buf *vbuf;     /* Virtual */
+        struct dir_cursor cursor;   /* Directory */
+    };
+};
 
-    node->type = type;
-    node->capacity = 1;
-    if (path != NULL)
-        node->path = strdup(path);
-    if (type == Directory)
-        node->content = NULL;
-    else
-        node->content = strdup("");
+#define handle_of(fi) ((struct file_handle *) (uintptr_t) (fi)->fh)
 
-    return node;
-}
+/*
+ * Locking: a directory's lock guards its children and their parent and
+ * unlinked fields; the root's is the lock of the bot index. Locks are
+ * taken parent before child, two bots' directories in address order
+ * (creating /a/b also links /b/a), and a conversation's lock after all
+ * of them.
+ *
+ * Entries whose directory does not exist, like /b/a before mkdir /b,
+ * wait in limbo keyed by path, and the directory adopts them when it is
+ * made.
+ */
+static struct daidai_node *root_node;
+static struct rb_root limbo = RB_ROOT;
+static pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static struct daidai_node *find_node(struct rb_root *root, const char *path) {
-    struct rb_node *node = root->rb_node;
+/*
+ * Inode numbers are node addresses, the root is FUSE_ROOT_ID. A node
+ * stays allocated until the kernel forgets it, so an ino never dangles.
+ *
+ * Every bot also has a read-only /a/.inbox view, in which /a/.inbox/b is
+ * /a/b read as a stream: each handle starts at the end and its reads
+ * return what was appended since the last one, whatever the offset.
+ * With -o framed, /a/b.tail/N shows the last N messages of /a/b.
+ *
+ * Views have no nodes of their own. Their inode numbers are those of the
+ * nodes they show with one of the low bits set (nodes are 64-byte
+ * aligned), and N above the bits of an address; the kernel's references
+ * to them count on those nodes.
+ */
+#define INBOX 1
+#define INBOX_NAME ".inbox"
+#define TAIL 2
+#define TAIL_SUFFIX ".tail"
+#define TAIL_SHIFT 48
+#define TAIL_MAX 0xffff
 
-    while (node) {
-        struct daidai_node *data = container_of(node, struct daidai_node, rb_node);
-        int result;
+#define ADDR_MASK ((((fuse_ino_t) 1 << TAIL_SHIFT) - 1) & ~(fuse_ino_t) (INBOX | TAIL))
 
-        result = strcmp(path, data->path);
+#define ino_of(node) ((node) == root_node ? FUSE_ROOT_ID : (fuse_ino_t) (uintptr_t) (node))
+#define node_of(ino) ((ino) == FUSE_ROOT_ID ? root_node : (struct daidai_node *) (uintptr_t) ((ino) & ADDR_MASK))
+#define view_of(ino) ((ino) == FUSE_ROOT_ID ? 0 : (ino) & ~ADDR_MASK)
+#define tail_view(n) (TAIL | (fuse_ino_t) (n) << TAIL_SHIFT)
+#define tail_count(view) ((view) >> TAIL_SHIFT)
 
-        if (result < 0)
-            node = node->rb_left;
-        else if (result > 0)
-            node = node->rb_right;
-        else
-            return data;
-    }
-    return NULL;
+/* the first 8 bytes of str, big-endian and zero padded: compares like strncmp */
+static uint64_t make_key(const char *str) {
+    uint64_t key = 0;
+    int i = 0;
+
+    for (; i < 8 && str[i] != '\0'; i++)
+        key = key << 8 | (unsigned char) str[i];
+    return key << (8 * (8 - i));
 }
 
-static int insert_node(struct rb_root *root, struct daidai_node *data) {
-    struct rb_node **new = &(root->rb_node), *parent = NULL;
+/* strcmp(a, b) for strings whose keys are a_key and b_key */
+static inline int key_cmp(uint64_t a_key, const char *a, uint64_t b_key, const char *b) {
+    if (a_key != b_key)
+        return a_key < b_key ? -1 : 1;
+    /* equal keys with a zero last byte: both strings ended inside the key */
+    if ((a_key & 0xff) == 0)
+        return 0;
+    return strcmp(a + 8, b + 8);
+}
 
-    /* Figure out where to put new node */
-    while (*new) {
-        struct daidai_node *this = container_of(*new, struct daidai_node, rb_node);
-        int result = strcmp(data->path, this->path);
 
-        parent = *new;
-        if (result < 0)
-            new = &((*new)->rb_left);
-        else if (result > 0)
-            new = &((*new)->rb_right);
-        else
-            return -1;
-    }
+/*
+ * Every heap allocation of the filesystem is counted, so /.alloc shows
+ * leaks and whether a path allocates at all.
+ */
+static struct {
+    uint64_t allocs;
+    uint64_t frees;
+} alloc_stats;
 
-    /* Add new node and rebalance tree. */
-    rb_link_node(&data->rb_node, parent, new);
-    rb_insert_color(&data->rb_node, root);
+#define count_alloc(ptr) \
+    do { if (ptr) __atomic_add_fetch(&alloc_stats.allocs, 1, __ATOMIC_RELAXED); } while (0)
 
-    return 0;
+static void *xmalloc(size_t size) {
+    void *ptr = malloc(size);
+    count_alloc(ptr);
+    return ptr;
 }
 
-static int erase_node(struct rb_root *root, const char *path) {
-    struct daidai_node *data = find_node(root, path);
-    if (data == NULL)
-        return -ENOENT;
-
-    rb_erase(&data->rb_node, root);
-    free_node(data);
-
-    return 0;
+static void *xcalloc(size_t nmemb, size_t size) {
+    void *ptr = calloc(nmemb, size);
+    count_alloc(ptr);
+    return ptr;
 }
 
-
-/* 
- * debug log file 
- */
-#ifdef debug
-
-static char *debugLog;
-
-static void printFunctionLog(const char *function, const char *path) {
-    strcat(debugLog, function);
-    strcat(debugLog, "\t");
-    strcat(debugLog, path);
-    strcat(debugLog, "\n");
+static void *xrealloc(void *old, size_t size) {
+    void *ptr = realloc(old, size);
+    if (old == NULL)
+        count_alloc(ptr);
+    return ptr;
 }
 
-static void printMsg(const char *function, const char *path, const char *msg) {
-    strcat(debugLog, function);
-    strcat(debugLog, "\t");
-    strcat(debugLog, path);
-    strcat(debugLog, "\t");
-    strcat(debugLog, msg);
-    strcat(debugLog, "\n");
+static void *xaligned(size_t align, size_t size) {
+    void *ptr;
+    if (posix_memalign(&ptr, align, size) != 0)
+        return NULL;
+    count_alloc(ptr);
+    return ptr;
 }
 
-#endif
+static void xfree(void *ptr) {
+    if (ptr != NULL)
+        __atomic_add_fetch(&alloc_stats.frees, 1, __ATOMIC_RELAXED);
+    free(ptr);
+}
 
+/* what the tree holds, for /.stats, atomic */
+static struct {
+    size_t nodes;
+    size_t convs;
+    size_t content;                 /* bytes in all conversations */
+} usage;
 
 /*
- * Command line options
+ * Nodes (with their path inline) and conversations come from slabs: 64 KiB
+ * blocks carved into one size class each, 64-byte steps up to 1 KiB and
+ * powers of two above. Freed objects go on their class's free list and
+ * are handed out again first; slabs are never given back.
  */
-static struct options {
-    int show_help;
-} options;
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_ALIGN 64
+#define SLAB_CLASSES 19             /* 64 .. 1024 by 64, then 2048 .. 8192 */
 
-#define OPTION(t, p)                           \
-    { t, offsetof(struct options, p), 1 }
-static const struct fuse_opt option_spec[] = {
-        OPTION("-h", show_help),
-        OPTION("--help", show_help),
-        FUSE_OPT_END
+static struct {
+    pthread_mutex_t lock;
+    struct slab_class {
+        void *free;
+        char *next, *end;           /* uncarved part of the newest slab */
+    } classes[SLAB_CLASSES];
+    uint64_t live;
+} slab = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
 };
 
-static char *reverse_path(const char *path) {
-    char *res = malloc(strlen(path) + 1);
+/* class of an object of size bytes and its rounded size, -1 if too big */
+static int slab_class(size_t size, size_t *class_size) {
+    if (size <= 1024) {
+        *class_size = (size + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+        return *class_size / SLAB_ALIGN - 1;
+    }
+    for (int class = 16; class < SLAB_CLASSES; class++) {
+        *class_size = (size_t) 2048 << (class - 16);
+        if (size <= *class_size)
+            return class;
+    }
+    return -1;
+}
 
-    const char *pos = NULL;
-    int cnt = 0;
-    for (const char *cur = path; *cur != '\0'; cur++) {
-        if (*cur != '/')
-            continue;
-        if (cnt == 0)
-            cnt++;
-        else {
-            pos = cur;
-            break;
+static void *slab_alloc(size_t size) {
+    size_t class_size;
+    int class = slab_class(size, &class_size);
+    if (class < 0)
+        return xmalloc(size);
+
+    pthread_mutex_lock(&slab.lock);
+    struct slab_class *sc = &slab.classes[class];
+    void *obj = sc->free;
+    if (obj != NULL)
+        sc->free = *(void **) obj;
+    else {
+        if ((size_t) (sc->end - sc->next) < class_size) {
+            char *block = xaligned(SLAB_ALIGN, SLAB_SIZE);
+            if (block == NULL) {
+                pthread_mutex_unlock(&slab.lock);
+                return NULL;
+            }
+            sc->next = block;
+            sc->end = block + SLAB_SIZE;
         }
+        obj = sc->next;
+        sc->next += class_size;
     }
+    slab.live++;
+    pthread_mutex_unlock(&slab.lock);
 
-    int idx = 0;
-    for (int cur = pos - path; path[cur] != '\0'; cur++, idx++)
-        res[idx] = path[cur];
-    res[idx++] = '/';
-    for (int cur = 1; path[cur] != '/'; cur++, idx++)
-        res[idx] = path[cur];
-    res[idx] = '\0';
-
-    return res;
+    return obj;
 }
 
-static void *daidai_init(struct fuse_conn_info *conn,
-                         struct fuse_config *cfg) {
-#ifdef debug
-    printFunctionLog("init", "");
-#endif
+static void slab_free(void *obj, size_t size) {
+    size_t class_size;
+    int class = slab_class(size, &class_size);
+    if (class < 0) {
+        xfree(obj);
+        return;
+    }
 
-    (void) conn;
-    cfg->kernel_cache = 0;
-    return NULL;
+    pthread_mutex_lock(&slab.lock);
+    *(void **) obj = slab.classes[class].free;
+    slab.classes[class].free = obj;
+    slab.live--;
+    pthread_mutex_unlock(&slab.lock);
 }
 
-static int daidai_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
-#ifdef debug
-    printFunctionLog("getattr", path);
-#endif
+static pthread_mutex_t chunk_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct chunk *chunk_pool = NULL;
+static int chunk_pool_len = 0;
 
-    (void) fi;
-    struct daidai_node *res = NULL;
+static struct chunk *alloc_chunk(void) {
+    pthread_mutex_lock(&chunk_pool_lock);
+    struct chunk *chunk = chunk_pool;
+    if (chunk != NULL) {
+        chunk_pool = chunk->next;
+        chunk_pool_len--;
+    }
+    pthread_mutex_unlock(&chunk_pool_lock);
 
-    memset(stbuf, 0, sizeof(struct stat));
-    res = find_node(&rb_root, path);
-    if (res == NULL)
-        return -ENOENT;
+    if (chunk == NULL)
+        return xmalloc(sizeof(struct chunk));
+    return chunk;
+}
 
-    if (res->type == Directory) {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
-    } else if (res->type == File) {
-        stbuf->st_mode = S_IFREG | 0444;
-        stbuf->st_nlink = 1;
-        stbuf->st_size = strlen(res->content);
-    } else
-        return -EPERM;
+static void free_chunk(struct chunk *chunk) {
+    pthread_mutex_lock(&chunk_pool_lock);
+    if (chunk_pool_len < CHUNK_POOL_MAX) {
+        chunk->next = chunk_pool;
+        chunk_pool = chunk;
+        chunk_pool_len++;
+        chunk = NULL;
+    }
+    pthread_mutex_unlock(&chunk_pool_lock);
 
-    return 0;
+    xfree(chunk);
 }
 
-static int daidai_open(const char *path, struct fuse_file_info *fi) {
-#ifdef debug
-    printFunctionLog("open", path);
-#endif
-
-    (void) fi;
+/*
+ * Eviction (-o max_memory=N)
+ *
+ * Conversations holding chunks sit on a CLOCK ring. Once the chunks add
+ * up to more than the budget, a worker sweeps the ring: a conversation
+ * touched since the last sweep gets another round, any other one has its
+ * body written to a slot in the spill file and its chunks freed. The
+ * spill file is mapped, so an evicted conversation is read like one from
+ * a snapshot: through base, faulting pages back in on read, and copying
+ * chunks out again only when they are overwritten. Sizes and the tree
+ * stay in memory, getattr and readdir never touch the spill file.
+ */
+#define SPILL_MAP_SIZE (1ULL << 40)
 
-    struct daidai_node *res = find_node(&rb_root, path);
-    if (res == NULL)
-        return -ENOENT;
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    size_t budget;                  /* bytes, 0 keeps everything */
+    size_t resident;                /* bytes in chunks, atomic */
+    struct conversation *hand;
+    int stop;
+    int running;
+    pthread_t thread;
 
-    return 0;
-}
+    int fd;                         /* spill file, unlinked */
+    const char *map;
+    off_t end;                      /* next free slot, under lock */
+} evict = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .wake = PTHREAD_COND_INITIALIZER,
+        .fd = -1,
+};
 
-static int daidai_read(const char *path, char *buf, size_t size, off_t offset,
-                       struct fuse_file_info *fi) {
-#ifdef debug
-    printFunctionLog("read", path);
-#endif
+#define evict_over() \
+    (evict.budget && __atomic_load_n(&evict.resident, __ATOMIC_RELAXED) > evict.budget)
 
-    size_t len;
-    (void) fi;
+#define touch_conv(conv) \
+    do { if (!__atomic_load_n(&(conv)->referenced, __ATOMIC_RELAXED)) \
+        __atomic_store_n(&(conv)->referenced, 1, __ATOMIC_RELAXED); } while (0)
 
-    struct daidai_node *res = find_node(&rb_root, path);
-    if (res == NULL)
-        return -ENOENT;
+/* conv gained n chunks, callers hold conv->lock for writing */
+static void track_chunks(struct conversation *conv, size_t n) {
+    if (!evict.budget || n == 0)
+        return;
 
-    len = strlen(res->content);
-    if (offset < len) {
-        if (offset + size > len)
-            size = len - offset;
-        memcpy(buf, res->content + offset, size);
-    } else
-        size = 0;
+    conv->nr_resident += n;
+    __atomic_add_fetch(&evict.resident, n * CHUNK_SIZE, __ATOMIC_RELAXED);
+    if (conv->nr_resident > n && !evict_over())
+        return;
 
-    return size;
+    pthread_mutex_lock(&evict.lock);
+    if (conv->nr_resident == n) {
+        /* join the ring just behind the hand, the last place it looks */
+        if (evict.hand == NULL) {
+            conv->clock_prev = conv->clock_next = conv;
+            evict.hand = conv;
+        } else {
+            conv->clock_next = evict.hand;
+            conv->clock_prev = evict.hand->clock_prev;
+            conv->clock_prev->clock_next = conv;
+            evict.hand->clock_prev = conv;
+        }
+    }
+    if (evict_over())
+        pthread_cond_signal(&evict.wake);
+    pthread_mutex_unlock(&evict.lock);
 }
 
-static int write_file(const char *path, const char *buf, size_t size, off_t offset) {
-    struct daidai_node *res = find_node(&rb_root, path);
-    if (res == NULL)
-        return -ENOENT;
+/* conv dropped all its chunks */
+static void untrack_chunks(struct conversation *conv) {
+    if (conv->nr_resident == 0)
+        return;
 
-    while (offset + size > res->capacity) {
-        char *tmp = res->content;
-        size_t len = strlen(tmp);
-        res->capacity *= 2;
-        char *new_space = malloc(res->capacity);
-        memcpy(new_space, tmp, len);
-        free(tmp);
-        res->content = new_space;
+    pthread_mutex_lock(&evict.lock);
+    if (conv->clock_next == conv)
+        evict.hand = NULL;
+    else {
+        conv->clock_prev->clock_next = conv->clock_next;
+        conv->clock_next->clock_prev = conv->clock_prev;
+        if (evict.hand == conv)
+            evict.hand = conv->clock_next;
     }
+    pthread_mutex_unlock(&evict.lock);
 
-    memcpy(res->content + offset, buf, size);
+    __atomic_sub_fetch(&evict.resident, conv->nr_resident * CHUNK_SIZE, __ATOMIC_RELAXED);
+    conv->nr_resident = 0;
+}
 
-    return 0;
+/* give the disk space of conv's spill slot back */
+static void drop_spill(struct conversation *conv) {
+    if (conv->spill_cap == 0)
+        return;
+    /* fallocate() itself wants _GNU_SOURCE, whose struct file_handle clashes with ours */
+    syscall(SYS_fallocate, evict.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            (off_t) conv->spill_off, (off_t) conv->spill_cap);
+    conv->spill_cap = 0;
 }
 
-static int daidai_write(const char *path, const char *buf, size_t size, off_t offset,
-                        struct fuse_file_info *fi) {
-#ifdef debug
-    printFunctionLog("write", path);
-#endif
+static struct conversation *create_conv(void) {
+    struct conversation *conv = slab_alloc(sizeof(struct conversation));
 
-    (void) fi;
-    write_file(path, buf, size, offset);
+    pthread_rwlock_init(&conv->lock, NULL);
+    conv->chunks = NULL;
+    conv->stamps = NULL;
+    conv->base = NULL;
+    conv->base_size = 0;
+    conv->nr_chunks = 0;
+    conv->max_chunks = 0;
+    conv->start = 0;
+    conv->size = 0;
+    conv->tail = 0;
+    conv->refcount = 1;
+    conv->ends = NULL;
+    conv->shard = -1;
+    conv->waiters = NULL;
+    conv->inval_pending = 0;
+    conv->inval_next = NULL;
+    conv->snap_gen = 0;
+    conv->snap_id = 0;
+    conv->snap_marks = 0;
+    conv->nr_resident = 0;
+    conv->referenced = 0;
+    conv->clock_prev = conv->clock_next = NULL;
+    conv->spill_off = 0;
+    conv->spill_cap = 0;
+    conv->base_marks = NULL;
+    conv->nr_base_marks = 0;
+    conv->marks = NULL;
+    conv->first_mark = 0;
+    conv->nr_marks = 0;
+    conv->max_marks = 0;
+    conv->dropped_marks = 0;
+    memset(&conv->retain, 0, sizeof(conv->retain));
+    __atomic_add_fetch(&usage.convs, 1, __ATOMIC_RELAXED);
 
-    //reverse
-    const char *rev_path = reverse_path(path);
-#ifdef debug
-    printFunctionLog("write: reverse path", rev_path);
-#endif
+    return conv;
+}
 
-    write_file(rev_path, buf, size, offset);
+static struct conversation *get_conv(struct conversation *conv) {
+    __atomic_add_fetch(&conv->refcount, 1, __ATOMIC_RELAXED);
+    return conv;
+}
 
-    return size;
+/* a reference unless conv is already on its way out, for the CLOCK ring */
+static int tryget_conv(struct conversation *conv) {
+    int ref = __atomic_load_n(&conv->refcount, __ATOMIC_RELAXED);
+
+    do {
+        if (ref == 0)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&conv->refcount, &ref, ref + 1, 1,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    return 1;
 }
 
-static int daidai_mkdir(const char *path, mode_t mode) {
-#ifdef debug
-    printFunctionLog("mkdir", path);
-#endif
+static void put_conv(struct conversation *conv) {
+    if (__atomic_sub_fetch(&conv->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    untrack_chunks(conv);
+    drop_spill(conv);
+    for (size_t i = 0; i < conv->nr_chunks; i++)
+        if (conv->chunks[i] != NULL)
+            free_chunk(conv->chunks[i]);
+    xfree(conv->chunks);
+    xfree(conv->stamps);
+    xfree(conv->marks);
+    __atomic_sub_fetch(&usage.convs, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&usage.content, conv->size - conv->start, __ATOMIC_RELAXED);
+    pthread_rwlock_destroy(&conv->lock);
+    slab_free(conv, sizeof(struct conversation));
+}
 
-    (void) mode;
+/* make sure the chunks covering [conv->start, end) exist and [start, end) is writable */
+static int conv_reserve(struct conversation *conv, size_t start, size_t end) {
+    size_t need = (end - conv->start + CHUNK_SIZE - 1) / CHUNK_SIZE;
 
-    struct daidai_node *node = create_node(Directory, path);
-    int res = insert_node(&rb_root, node);
-    if (res != 0) {
-        free_node(node);
-        return -EEXIST;
+    /* copy out the part of the snapshot image about to be overwritten */
+    for (size_t i = (start - conv->start) / CHUNK_SIZE; i < need && i < conv->nr_chunks; i++) {
+        if (conv->chunks[i] != NULL)
+            continue;
+        struct chunk *chunk = alloc_chunk();
+        if (chunk == NULL)
+            return -ENOMEM;
+        size_t len = conv->base_size - i * CHUNK_SIZE;
+        memcpy(chunk->data, conv->base + i * CHUNK_SIZE, len < CHUNK_SIZE ? len : CHUNK_SIZE);
+        conv->chunks[i] = chunk;
+        track_chunks(conv, 1);
+    }
+
+    if (need > conv->max_chunks) {
+        size_t max_chunks = conv->max_chunks ? conv->max_chunks : 1;
+        while (need > max_chunks)
+            max_chunks *= 2;
+        struct chunk **chunks = xrealloc(conv->chunks, max_chunks * sizeof(struct chunk *));
+        if (chunks == NULL)
+            return -ENOMEM;
+        conv->chunks = chunks;
+        time_t *stamps = xrealloc(conv->stamps, max_chunks * sizeof(time_t));
+        if (stamps == NULL)
+            return -ENOMEM;
+        conv->stamps = stamps;
+        conv->max_chunks = max_chunks;
+    }
+    while (conv->nr_chunks < need) {
+        struct chunk *chunk = alloc_chunk();
+        if (chunk == NULL)
+            return -ENOMEM;
+        conv->stamps[conv->nr_chunks] = 0;
+        conv->chunks[conv->nr_chunks++] = chunk;
+        track_chunks(conv, 1);
     }
 
     return 0;
 }
 
-static int daidai_rmdir(const char *path) {
-#ifdef debug
-    printFunctionLog("rmdir", path);
-#endif
+/* copy size bytes of buf (zeros when buf is NULL) into conv at offset */
+static void conv_fill(struct conversation *conv, const char *buf, size_t size, size_t offset) {
+    while (size > 0) {
+        struct chunk *chunk = conv->chunks[(offset - conv->start) / CHUNK_SIZE];
+        size_t pos = offset % CHUNK_SIZE;
+        size_t len = CHUNK_SIZE - pos < size ? CHUNK_SIZE - pos : size;
+
+        if (buf != NULL) {
+            memcpy(chunk->data + pos, buf, len);
+            buf += len;
+        } else
+            memset(chunk->data + pos, 0, len);
+        offset += len;
+        size -= len;
+    }
+}
+
+/* the chunks [from, to) were appended to just now */
+static void stamp_chunks(struct conversation *conv, size_t from, size_t to) {
+    time_t now = time(NULL);
+
+    for (size_t i = (from - conv->start) / CHUNK_SIZE; i * CHUNK_SIZE < to - conv->start; i++)
+        conv->stamps[i] = now;
+}
 
-    int res = erase_node(&rb_root, path);
+/* what falls before conv->start was dropped already and is skipped */
+static int conv_write(struct conversation *conv, const char *buf, size_t size, size_t offset) {
+    if (offset + size <= conv->start)
+        return 0;
+    if (offset < conv->start) {
+        buf += conv->start - offset;
+        size -= conv->start - offset;
+        offset = conv->start;
+    }
+    int res = conv_reserve(conv, offset < conv->size ? offset : conv->size, offset + size);
     if (res != 0)
-        return -ENOENT;
+        return res;
+
+    /* a write past the end leaves a hole that reads back as zeros */
+    if (offset > conv->size)
+        conv_fill(conv, NULL, offset - conv->size, conv->size);
+    conv_fill(conv, buf, size, offset);
+    stamp_chunks(conv, offset, offset + size);
+    if (offset + size > conv->size) {
+        __atomic_add_fetch(&usage.content, offset + size - conv->size, __ATOMIC_RELAXED);
+        conv->size = conv->tail = offset + size;
+    }
 
     return 0;
 }
 
-static int daidai_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
-                          struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
-#ifdef debug
-    printFunctionLog("readdir", path);
-#endif
+/* gather up to size bytes at offset into buf, returns the bytes copied; dropped bytes read as the end */
+static size_t conv_read(struct conversation *conv, char *buf, size_t size, size_t offset) {
+    if (offset < conv->start || offset >= conv->size)
+        return 0;
+    if (offset + size > conv->size)
+        size = conv->size - offset;
 
-    (void) offset;
-    (void) fi;
-    (void) flags;
+    size_t done = 0;
+    while (done < size) {
+        size_t i = (offset - conv->start) / CHUNK_SIZE;
+        const char *data = conv->chunks[i] ? conv->chunks[i]->data : conv->base + i * CHUNK_SIZE;
+        size_t pos = offset % CHUNK_SIZE;
+        size_t len = CHUNK_SIZE - pos < size - done ? CHUNK_SIZE - pos : size - done;
 
-    struct daidai_node *res = find_node(&rb_root, path);
-    if (res == NULL || res->type != Directory)
-        return -ENOENT;
+        memcpy(buf + done, data + pos, len);
+        offset += len;
+        done += len;
+    }
 
-    filler(buf, ".", NULL, 0, 0);
-    filler(buf, "..", NULL, 0, 0);
+    return done;
+}
 
-    for (struct rb_node *node = rb_next(&res->rb_node); node != NULL; node = rb_next(node)) {
-        struct daidai_node *entry = rb_entry(node, struct daidai_node, rb_node);
+/*
+ * the same bytes described in place, one iovec per chunk: iov has room
+ * for conv_iov_max(size). The memory stays valid while conv->lock is
+ * held, returns the number of iovecs.
+ */
+#define conv_iov_max(size) ((size) / CHUNK_SIZE + 2)
 
-        const char *sub_path = entry->path;
-        if (path[0] == '/' && strlen(path) == 1 && sub_path[0] == '/') {
-            if (strchr(sub_path + 1, '/') != NULL)
-                continue;
-            filler(buf, sub_path + 1, NULL, 0, 0);
-        } else {
-            while (*path != '\0' && *sub_path != '\0' && *path == *sub_path) {
-                path++;
-                sub_path++;
-            }
-            if (*path == '\0' && *sub_path == '/') {
-                if (strchr(sub_path + 1, '/') != NULL)
-                    continue;
-                filler(buf, sub_path + 1, NULL, 0, 0);
-            } else
-                break;
-        }
+static int conv_iov(struct conversation *conv, size_t size, size_t offset, struct iovec *iov) {
+    if (offset < conv->start || offset >= conv->size)
+        return 0;
+    if (offset + size > conv->size)
+        size = conv->size - offset;
 
-#ifdef debug
-        printMsg("readdir", path, sub_path);
-#endif
+    int n = 0;
+    while (size > 0) {
+        size_t i = (offset - conv->start) / CHUNK_SIZE;
+        char *data = conv->chunks[i] ? conv->chunks[i]->data : (char *) conv->base + i * CHUNK_SIZE;
+        size_t pos = offset % CHUNK_SIZE;
+        size_t len = CHUNK_SIZE - pos < size ? CHUNK_SIZE - pos : size;
+
+        iov[n].iov_base = data + pos;
+        iov[n++].iov_len = len;
+        offset += len;
+        size -= len;
     }
 
-    return 0;
+    return n;
 }
 
-static int daidai_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-#ifdef debug
-    printFunctionLog("create", path);
-#endif
+/*
+ * Appends
+ *
+ * Every write to a conversation goes to its tail, whatever offset the
+ * kernel passed, so bots writing at the same time never overwrite each
+ * other. An append holds the lock only to move tail past its bytes and
+ * make sure their chunks exist, and copies without it: it keeps its own
+ * list of the chunks, since chunks[] may be reallocated meanwhile by the
+ * next append. Appends then publish in the order they claimed, moving
+ * size and journaling under the lock again; one that finished early
+ * yields until those before it are done. Nothing reads or evicts the
+ * bytes between size and tail.
+ */
+#define APPEND_INLINE 4
 
-    (void) mode;
-    (void) fi;
+struct append {
+    size_t offset;
+    size_t size;
+    size_t nr_chunks;
+    struct chunk **chunks;          /* those covering [offset, offset + size) */
+    struct chunk *inline_chunks[APPEND_INLINE];
+};
 
-    //reverse
-    char *rev_path = reverse_path(path);
-#ifdef debug
-    printFunctionLog("create: reverse path", rev_path);
-#endif
+/* callers hold conv->lock for writing */
+static int claim_append(struct conversation *conv, size_t size, struct append *app) {
+    size_t first = (conv->tail - conv->start) / CHUNK_SIZE;
+    size_t nr = size ? (conv->tail - conv->start + size - 1) / CHUNK_SIZE - first + 1 : 0;
+
+    app->chunks = nr <= APPEND_INLINE ? app->inline_chunks : xmalloc(nr * sizeof(struct chunk *));
+    if (app->chunks == NULL)
+        return -ENOMEM;
+    int res = conv_reserve(conv, conv->tail, conv->tail + size);
+    if (res != 0) {
+        if (app->chunks != app->inline_chunks)
+            xfree(app->chunks);
+        return res;
+    }
 
-    struct daidai_node *node = create_node(File, path);
-    struct daidai_node *rev_node = create_node(File, rev_path);
-    insert_node(&rb_root, node);
-    insert_node(&rb_root, rev_node);
+    memcpy(app->chunks, conv->chunks + first, nr * sizeof(struct chunk *));
+    app->nr_chunks = nr;
+    app->offset = conv->tail;
+    app->size = size;
+    conv->tail += size;
 
     return 0;
 }
 
-static int daidai_mknod(const char *path, mode_t mode, dev_t dev) {
-#ifdef debug
-    printFunctionLog("mknod", path);
-#endif
+/* copy len bytes of buf (zeros when buf is NULL) to pos in the claimed space, no lock needed */
+static void fill_append(const struct append *app, size_t pos, const char *buf, size_t len) {
+    size_t offset = app->offset + pos, first = app->offset / CHUNK_SIZE;
 
-    (void) mode;
-    (void) dev;
+    while (len > 0) {
+        struct chunk *chunk = app->chunks[offset / CHUNK_SIZE - first];
+        size_t at = offset % CHUNK_SIZE;
+        size_t n = CHUNK_SIZE - at < len ? CHUNK_SIZE - at : len;
 
-    struct daidai_node *node = create_node(File, path);
-    int res = insert_node(&rb_root, node);
-    if (res != 0) {
-        free_node(node);
-        return -EEXIST;
+        if (buf != NULL) {
+            memcpy(chunk->data + at, buf, n);
+            buf += n;
+        } else
+            memset(chunk->data + at, 0, n);
+        offset += n;
+        len -= n;
     }
+}
 
-    return 0;
+/* the claimed space as memory buffers, bufv has room for app->nr_chunks */
+static void append_bufv(const struct append *app, struct fuse_bufvec *bufv) {
+    size_t offset = app->offset, end = app->offset + app->size;
+
+    bufv->count = app->nr_chunks;
+    bufv->idx = 0;
+    bufv->off = 0;
+    for (size_t i = 0; offset < end; i++) {
+        size_t at = offset % CHUNK_SIZE;
+        size_t len = CHUNK_SIZE - at < end - offset ? CHUNK_SIZE - at : end - offset;
+
+        bufv->buf[i] = (struct fuse_buf) {.size = len, .mem = app->chunks[i]->data + at, .fd = -1};
+        offset += len;
+    }
 }
 
-static int daidai_unlink(const char *path) {
-#ifdef debug
-    printFunctionLog("unlink", path);
-#endif
+/* wait for the appends claimed before app and take conv->lock for writing */
+static void publish_wait(struct conversation *conv, const struct append *app) {
+    while (__atomic_load_n(&conv->size, __ATOMIC_ACQUIRE) != app->offset)
+        sched_yield();
+    pthread_rwlock_wrlock(&conv->lock);
+}
 
-    int res = erase_node(&rb_root, path);
-    if (res != 0)
-        return -ENOENT;
+/* make app readable, callers hold conv->lock for writing */
+static void publish_append(struct conversation *conv, struct append *app) {
+    stamp_chunks(conv, app->offset, app->offset + app->size);
+    __atomic_store_n(&conv->size, app->offset + app->size, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&usage.content, app->size, __ATOMIC_RELAXED);
+    if (app->chunks != app->inline_chunks)
+        xfree(app->chunks);
+}
 
-    return 0;
+/*
+ * Framing (-o framed)
+ *
+ * Every write appended, and every /.batch record, is one message. The
+ * index keeps where each message ends, in the order they were published,
+ * so the last n messages start where message count - n - 1 ends and are
+ * found without reading the conversation. The ends saved in a snapshot
+ * are used in place from its image.
+ */
+static size_t nr_marks(const struct conversation *conv) {
+    return conv->nr_base_marks + conv->nr_marks;
 }
 
-static int daidai_release(const char *path, struct fuse_file_info *fi) {
-#ifdef debug
-    printFunctionLog("release", path);
-#endif
+static uint64_t mark_at(const struct conversation *conv, size_t i) {
+    return i < conv->nr_base_marks ? conv->base_marks[i] :
+           conv->marks[conv->first_mark + i - conv->nr_base_marks];
+}
 
-    (void) fi;
+/* callers hold conv->lock for writing, a replayed record may end where a message already does */
+static int add_mark(struct conversation *conv, uint64_t end) {
+    size_t nr = nr_marks(conv);
+    if ((nr > 0 && mark_at(conv, nr - 1) >= end) || end <= conv->start)
+        return 0;
+
+    /* slide the live ones down once at least half of the array was dropped */
+    if (conv->first_mark + conv->nr_marks == conv->max_marks && conv->first_mark >= conv->nr_marks) {
+        memmove(conv->marks, conv->marks + conv->first_mark, conv->nr_marks * sizeof(uint64_t));
+        conv->first_mark = 0;
+    }
+    if (conv->first_mark + conv->nr_marks == conv->max_marks) {
+        size_t max = conv->max_marks ? conv->max_marks * 2 : 16;
+        uint64_t *marks = xrealloc(conv->marks, max * sizeof(uint64_t));
+        if (marks == NULL)
+            return -ENOMEM;
+        conv->marks = marks;
+        conv->max_marks = max;
+    }
+    conv->marks[conv->first_mark + conv->nr_marks++] = end;
 
     return 0;
 }
 
-static int daidai_utimens(const char *path, const struct timespec tv[2],
-                          struct fuse_file_info *fi) {
-#ifdef debug
-    printFunctionLog("utimens", path);
-#endif
+/*
+ * the bytes [*from, *to) of the last n messages, callers hold conv->lock.
+ * The oldest kept message may have lost its beginning to retention.
+ */
+static void last_messages(const struct conversation *conv, size_t n, size_t *from, size_t *to) {
+    size_t nr = nr_marks(conv);
 
-    (void) path;
-    (void) tv[2];
-    (void) fi;
+    *to = nr ? mark_at(conv, nr - 1) : conv->start;
+    *from = nr > n ? mark_at(conv, nr - n - 1) : conv->start;
+}
+
+static int free_node(struct daidai_node *data) {
+    struct conversation *conv = data->conv;
+
+    if (conv != NULL) {
+        pthread_rwlock_wrlock(&conv->lock);
+        struct daidai_node **end = &conv->ends;
+        while (*end != data)
+            end = &(*end)->conv_next;
+        *end = data->conv_next;
+        pthread_rwlock_unlock(&conv->lock);
+        put_conv(conv);
+    }
+    if (data->lock != NULL) {
+        pthread_rwlock_destroy(data->lock);
+        slab_free(data->lock, sizeof(pthread_rwlock_t));
+    }
+    slab_free(data, node_size(strlen(data->path)));
+    __atomic_sub_fetch(&usage.nodes, 1, __ATOMIC_RELAXED);
 
     return 0;
 }
 
-static const struct fuse_operations daidai_oper = {
-        .init       = daidai_init,
-        .getattr    = daidai_getattr,
-        .open       = daidai_open,
-        .read       = daidai_read,
-        .write      = daidai_write,
-        .mkdir      = daidai_mkdir,
-        .rmdir      = daidai_rmdir,
-        .readdir    = daidai_readdir,
-        .create     = daidai_create,
-        .mknod      = daidai_mknod,
-        .unlink     = daidai_unlink,
-        .release    = daidai_release,
-        .utimens    = daidai_utimens,
-};
+/*
+ * A File node shares conv when it is given, otherwise it starts a new
+ * conversation of its own. The node starts with the reference its
+ * directory will hold.
+ */
+static struct daidai_node *create_node(int type, const char *path, struct conversation *conv) {
+    size_t len = strlen(path);
+    struct daidai_node *node = slab_alloc(node_size(len));
+    memset(node, 0, sizeof(struct daidai_node));
 
+    node->type = type;
+    memcpy(node->path, path, len + 1);
+    node->name = strrchr(node->path, '/') + 1;
+    node->name_key = make_key(node->name);
+    node->children = RB_ROOT;
+    node->refs = 1;
+    __atomic_add_fetch(&usage.nodes, 1, __ATOMIC_RELAXED);
+    if (type == Directory) {
+        node->lock = slab_alloc(sizeof(pthread_rwlock_t));
+        pthread_rwlock_init(node->lock, NULL);
+    }
+    if (type != File)
+        node->conv = NULL;
+    else if (conv != NULL)
+        node->conv = get_conv(conv);
+    else
+        node->conv = create_conv();
+    if (node->conv != NULL) {
+        pthread_rwlock_wrlock(&node->conv->lock);
+        node->conv_next = node->conv->ends;
+        node->conv->ends = node;
+        pthread_rwlock_unlock(&node->conv->lock);
+    }
 
-static void show_help(const char *progname) {
-    printf("usage: %s [options] <mountpoint>\n\n", progname);
-    printf("File-system specific options:\n"
-           "no options at present"
-           "\n");
+    return node;
 }
 
+static void put_node(struct daidai_node *data, uint64_t n) {
+    if (__atomic_sub_fetch(&data->refs, n, __ATOMIC_ACQ_REL) == 0)
+        free_node(data);
+}
 
-int main(int argc, char *argv[]) {
-    int ret;
-    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+#define child_of(node) ((node) ? rb_entry(node, struct daidai_node, child_node) : NULL)
 
-    /* initialize */
-    struct daidai_node *root_node = create_node(Directory, "/");
-    insert_node(&rb_root, root_node);
-
-#ifdef debug
-    struct daidai_node *log_node = create_node(File, "/log_file");
-    debugLog = malloc(100000);
-    log_node->content = debugLog;
-    insert_node(&rb_root, log_node);
-#endif
+static struct daidai_node *find_child(struct daidai_node *dir, const char *name) {
+    struct rb_node *node = dir->children.rb_node;
+    uint64_t key = make_key(name);
 
-    /* Parse options */
-    if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
-        return 1;
+    while (node) {
+        struct daidai_node *data = container_of(node, struct daidai_node, child_node);
+        int result = key_cmp(key, name, data->name_key, data->name);
 
-    /* When --help is specified, first print our own file-system
-       specific help text, then signal fuse_main to show
-       additional help (by adding `--help` to the options again)
-       without usage: line (by setting argv[0] to the empty
-       string) */
-    if (options.show_help) {
-        show_help(argv[0]);
-        assert(fuse_opt_add_arg(&args, "--help") == 0);
-        args.argv[0][0] = '\0';
+        if (result < 0)
+            node = node->rb_left;
+        else if (result > 0)
+            node = node->rb_right;
+        else
+            return data;
+    }
+    return NULL;
+}
+
+/* first child whose name sorts after name, for resuming readdir */
+static struct daidai_node *next_child(struct daidai_node *dir, const char *name) {
+    struct rb_node *node = dir->children.rb_node;
+    struct daidai_node *next = NULL;
+    uint64_t key = make_key(name);
+
+    while (node) {
+        struct daidai_node *data = container_of(node, struct daidai_node, child_node);
+
+        if (key_cmp(key, name, data->name_key, data->name) < 0) {
+            next = data;
+            node = node->rb_left;
+        } else
+            node = node->rb_right;
+    }
+    return next;
+}
+
+static void insert_child(struct daidai_node *dir, struct daidai_node *data) {
+    struct rb_node **new = &(dir->children.rb_node), *parent = NULL;
+
+    while (*new) {
+        struct daidai_node *this = container_of(*new, struct daidai_node, child_node);
+
+        parent = *new;
+        if (key_cmp(data->name_key, data->name, this->name_key, this->name) < 0)
+            new = &((*new)->rb_left);
+        else
+            new = &((*new)->rb_right);
+    }
+
+    rb_link_node(&data->child_node, parent, new);
+    rb_insert_color(&data->child_node, &dir->children);
+    data->parent = dir;
+}
+
+static void erase_child(struct daidai_node *data) {
+    rb_erase(&data->child_node, &data->parent->children);
+    data->parent = NULL;
+}
+
+/* the limbo, under limbo_lock */
+static struct daidai_node *limbo_find(const char *path) {
+    struct rb_node *node = limbo.rb_node;
+
+    while (node) {
+        struct daidai_node *data = child_of(node);
+        int result = strcmp(path, data->path);
+
+        if (result < 0)
+            node = node->rb_left;
+        else if (result > 0)
+            node = node->rb_right;
+        else
+            return data;
+    }
+    return NULL;
+}
+
+/* first entry whose path sorts after path */
+static struct daidai_node *limbo_next(const char *path) {
+    struct rb_node *node = limbo.rb_node;
+    struct daidai_node *next = NULL;
+
+    while (node) {
+        struct daidai_node *data = child_of(node);
+
+        if (strcmp(path, data->path) < 0) {
+            next = data;
+            node = node->rb_left;
+        } else
+            node = node->rb_right;
+    }
+    return next;
+}
+
+static void limbo_insert(struct daidai_node *data) {
+    struct rb_node **new = &(limbo.rb_node), *parent = NULL;
+
+    while (*new) {
+        parent = *new;
+        if (strcmp(data->path, child_of(*new)->path) < 0)
+            new = &((*new)->rb_left);
+        else
+            new = &((*new)->rb_right);
+    }
+
+    rb_link_node(&data->child_node, parent, new);
+    rb_insert_color(&data->child_node, &limbo);
+}
+
+/* a new directory picks up the entries that were waiting for it */
+static void adopt_children(struct daidai_node *dir) {
+    size_t len = strlen(dir->path);
+
+    pthread_mutex_lock(&limbo_lock);
+    struct daidai_node *entry = limbo_next(dir->path);
+    while (entry != NULL && strncmp(entry->path, dir->path, len) == 0) {
+        struct daidai_node *next = child_of(rb_next(&entry->child_node));
+
+        if (entry->path[len] == '/' && entry->name == entry->path + len + 1) {
+            rb_erase(&entry->child_node, &limbo);
+            insert_child(dir, entry);
+        }
+        entry = next;
+    }
+    pthread_mutex_unlock(&limbo_lock);
+}
+
+/* the entry at path of dir, or of the limbo when dir is NULL */
+static struct daidai_node *lookup_in(struct daidai_node *dir, const char *path) {
+    if (dir != NULL)
+        return find_child(dir, strrchr(path, '/') + 1);
+
+    pthread_mutex_lock(&limbo_lock);
+    struct daidai_node *node = limbo_find(path);
+    pthread_mutex_unlock(&limbo_lock);
+    return node;
+}
+
+/* link data into dir, or the limbo; callers hold dir->lock for writing */
+static void insert_node(struct daidai_node *dir, struct daidai_node *data) {
+    if (dir != NULL)
+        insert_child(dir, data);
+    else {
+        pthread_mutex_lock(&limbo_lock);
+        limbo_insert(data);
+        pthread_mutex_unlock(&limbo_lock);
+    }
+    if (data->type == Directory)
+        adopt_children(data);
+}
+
+/* detach data from its directory or the limbo, callers hold that directory's lock */
+static void detach_node(struct daidai_node *data) {
+    if (data->parent != NULL)
+        erase_child(data);
+    else {
+        pthread_mutex_lock(&limbo_lock);
+        rb_erase(&data->child_node, &limbo);
+        pthread_mutex_unlock(&limbo_lock);
+    }
+}
+
+/*
+ * Unlink a file from its directory, callers hold that directory's lock
+ * for writing. It is freed once the kernel forgets it; directories go
+ * through erase_tree.
+ */
+static void erase_node(struct daidai_node *data) {
+    detach_node(data);
+    data->unlinked = 1;
+    put_node(data, 1);
+}
+
+/* a directory right below the root */
+static int is_bot(struct daidai_node *dir) {
+    return dir != root_node && dir->type == Directory && strchr(dir->path + 1, '/') == NULL;
+}
+
+/* names that would hide, or be hidden by, a bot's inbox */
+static int reserved_name(struct daidai_node *dir, const char *name) {
+    if (strcmp(name, INBOX_NAME) != 0)
+        return 0;
+    return dir == root_node ? -EINVAL : is_bot(dir) ? -EEXIST : 0;
+}
+
+/* "/a/b" is bot a's end of its conversation with bot b */
+static int is_conversation(const char *path) {
+    const char *sep = strchr(path + 1, '/');
+
+    return sep != NULL && sep[1] != '\0' && strchr(sep + 1, '/') == NULL;
+}
+
+/*
+ * Groups
+ *
+ * A bot whose name starts with '@' is a group: /a/@room is a's end of the
+ * group and /@room/a lists a as a member. All the ends of a group share
+ * one conversation, so a message written once is read by every member,
+ * and a write costs the same whatever the group's size. The group has to
+ * be there for a bot to join it; unlinking either end leaves it.
+ */
+#define GROUP_MARK '@'
+
+/* "/a/b" where a or b is a group */
+static int is_group_path(const char *path) {
+    return is_conversation(path) && (path[1] == GROUP_MARK || strrchr(path, '/')[1] == GROUP_MARK);
+}
+
+/* the conversation of room's members, NULL before the first one joins; callers hold room->lock */
+static struct conversation *group_conv(struct daidai_node *room) {
+    struct daidai_node *entry = child_of(rb_first(&room->children));
+
+    for (; entry != NULL; entry = child_of(rb_next(&entry->child_node)))
+        if (entry->type == File)
+            return entry->conv;
+    return NULL;
+}
+
+/* the directory of the other end of path, NULL for the limbo; callers hold the bot index */
+static struct daidai_node *peer_dir(const char *path) {
+    if (!is_conversation(path))
+        return NULL;
+
+    struct daidai_node *dir = find_child(root_node, strrchr(path, '/') + 1);
+    return dir != NULL && dir->type == Directory ? dir : NULL;
+}
+
+/*
+ * Resolve path one component at a time, stepping into the limbo where a
+ * directory is missing. Only for code that runs before the session starts
+ * and so takes no locks: replay and loading the snapshot.
+ */
+static struct daidai_node *find_node(const char *path) {
+    struct daidai_node *node = root_node;
+    char buf[PATH_MAX];
+    size_t len = strlen(path);
+
+    if (len >= PATH_MAX || path[0] != '/')
+        return NULL;
+    memcpy(buf, path, len + 1);
+
+    /* cut buf after each component in turn, it is then the prefix's path */
+    for (char *pos = buf; *pos == '/';) {
+        char *end = strchr(pos + 1, '/');
+        if (end == pos + 1)
+            return NULL;
+        if (end != NULL)
+            *end = '\0';
+        if (pos[1] == '\0')
+            return node;
+
+        node = node != NULL && node->type == Directory ? find_child(node, pos + 1) : NULL;
+        if (node == NULL)
+            node = lookup_in(NULL, buf);
+        if (end == NULL)
+            break;
+        *end = '/';
+        pos = end;
+    }
+    return node;
+}
+
+/* the directory path would be linked into, NULL for the limbo */
+static struct daidai_node *parent_dir(const char *path) {
+    char parent_path[PATH_MAX];
+    size_t len = strrchr(path, '/') - path;
+
+    if (len >= PATH_MAX)
+        return NULL;
+    if (len == 0)
+        return root_node;
+    memcpy(parent_path, path, len);
+    parent_path[len] = '\0';
+
+    struct daidai_node *dir = find_node(parent_path);
+    return dir != NULL && dir->type == Directory ? dir : NULL;
+}
+
+/* link data wherever its path says, before the session starts */
+static int link_node(struct daidai_node *data) {
+    struct daidai_node *dir = parent_dir(data->path);
+
+    if (lookup_in(dir, data->path) != NULL)
+        return -EEXIST;
+    insert_node(dir, data);
+    return 0;
+}
+
+
+/* 
+ * debug log file 
+ *
+ * A ring of fixed-size line slots. Writers claim a slot with one atomic
+ * increment and format straight into it; old lines are overwritten once
+ * the ring wraps. Each slot carries a sequence number like a seqlock, so
+ * /log_file can copy lines out without stopping the writers.
+ */
+#define LOG_LINES_DEFAULT 4096
+#define LOG_LINE_MAX 256
+
+struct log_slot {
+    uint64_t seq;                   /* line number + 1, 0 while writing */
+    unsigned int len;
+    char line[LOG_LINE_MAX];
+};
+
+static struct log_slot *debugLog;
+static uint64_t debugLogMask;
+static uint64_t debugLogNext;
+
+static void initLog(unsigned int lines) {
+    uint64_t nr_slots = 1;
+    while (nr_slots * 2 <= lines)
+        nr_slots *= 2;
+
+    debugLog = xcalloc(nr_slots, sizeof(struct log_slot));
+    debugLogMask = nr_slots - 1;
+}
+
+static struct log_slot *claimLog(uint64_t *seq) {
+    *seq = __atomic_fetch_add(&debugLogNext, 1, __ATOMIC_RELAXED);
+    struct log_slot *slot = &debugLog[*seq & debugLogMask];
+
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return slot;
+}
+
+static void publishLog(struct log_slot *slot, uint64_t seq, int len) {
+    if (len < 0)
+        len = 0;
+    if (len >= LOG_LINE_MAX) {
+        len = LOG_LINE_MAX;
+        slot->line[LOG_LINE_MAX - 1] = '\n';
+    }
+    slot->len = len;
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+static void printFunctionLog(const char *function, const char *path) {
+    if (path == NULL)
+        path = "-";
+
+    uint64_t seq;
+    struct log_slot *slot = claimLog(&seq);
+    publishLog(slot, seq, snprintf(slot->line, LOG_LINE_MAX, "%s\t%s\n", function, path));
+}
+
+static void printMsg(const char *function, const char *path, const char *msg) {
+    if (path == NULL)
+        path = "-";
+
+    uint64_t seq;
+    struct log_slot *slot = claimLog(&seq);
+    publishLog(slot, seq, snprintf(slot->line, LOG_LINE_MAX, "%s\t%s\t%s\n", function, path, msg));
+}
+
+/* copy out the lines still in the ring, skipping any being rewritten */
+static struct vfile_buf *renderLog(void) {
+    uint64_t end = __atomic_load_n(&debugLogNext, __ATOMIC_ACQUIRE);
+    uint64_t start = end > debugLogMask + 1 ? end - (debugLogMask + 1) : 0;
+
+    struct vfile_buf *out = xmalloc(sizeof(struct vfile_buf) + (end - start) * LOG_LINE_MAX);
+    if (out == NULL)
+        return NULL;
+    out->size = 0;
+
+    for (uint64_t seq = start; seq < end; seq++) {
+        struct log_slot *slot = &debugLog[seq & debugLogMask];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq + 1)
+            continue;
+        unsigned int len = slot->len;
+        if (len > LOG_LINE_MAX)
+            continue;
+        memcpy(out->data + out->size, slot->line, len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq + 1)
+            continue;
+        out->size += len;
+    }
+
+    return out;
+}
+
+static const struct vfile_ops log_file_ops = {
+        .render = renderLog,
+};
+
+/*
+ * Tracing is chosen per operation at runtime, with -o trace=LIST or by
+ * writing to /.trace. When an operation is not traced, traceLog costs a
+ * single test of trace_mask.
+ */
+enum trace_op {
+    TRACE_INIT,
+    TRACE_LOOKUP,
+    TRACE_FORGET,
+    TRACE_GETATTR,
+    TRACE_SETATTR,
+    TRACE_OPEN,
+    TRACE_READ,
+    TRACE_WRITE,
+    TRACE_MKDIR,
+    TRACE_RMDIR,
+    TRACE_OPENDIR,
+    TRACE_READDIR,
+    TRACE_RELEASEDIR,
+    TRACE_MKNOD,
+    TRACE_CREATE,
+    TRACE_UNLINK,
+    TRACE_RELEASE,
+    TRACE_POLL,
+    TRACE_OPS
+};
+
+static const char *const trace_names[TRACE_OPS] = {
+        "init", "lookup", "forget", "getattr", "setattr", "open", "read", "write", "mkdir", "rmdir", "opendir",
+        "readdir", "releasedir", "mknod", "create", "unlink", "release", "poll",
+};
+
+#define TRACE_ALL ((1u << TRACE_OPS) - 1)
+
+static unsigned int trace_mask = 0;
+
+#define tracing(op) __builtin_expect(__atomic_load_n(&trace_mask, __ATOMIC_RELAXED) & (1u << (op)), 0)
+#define traceLog(op, path) \
+    do { if (tracing(op)) printFunctionLog(trace_names[op], path); } while (0)
+#define traceMsg(op, path, msg) \
+    do { if (tracing(op)) printMsg(trace_names[op], path, msg); } while (0)
+
+/*
+ * Words are separated by spaces, commas or newlines: "all", "none", an
+ * operation name, or a name prefixed with '+' or '-' to change just that
+ * one. A bare name on its own replaces the current selection.
+ */
+static unsigned int parse_trace(const char *list, unsigned int mask) {
+    int replaced = 0;
+
+    while (*list != '\0') {
+        size_t len = strcspn(list, " ,\t\n");
+        if (len == 0) {
+            list++;
+            continue;
+        }
+
+        char sign = 0;
+        const char *word = list;
+        if (*word == '+' || *word == '-') {
+            sign = *word++;
+            len--;
+        }
+
+        unsigned int bits = 0;
+        if (len == 3 && strncmp(word, "all", 3) == 0)
+            bits = TRACE_ALL;
+        else if (len == 4 && strncmp(word, "none", 4) == 0)
+            mask = 0;
+        for (int op = 0; op < TRACE_OPS; op++)
+            if (strlen(trace_names[op]) == len && strncmp(word, trace_names[op], len) == 0)
+                bits = 1u << op;
+
+        if (sign == '-')
+            mask &= ~bits;
+        else if (sign == '+')
+            mask |= bits;
+        else if (bits != 0) {
+            if (!replaced)
+                mask = 0;
+            replaced = 1;
+            mask |= bits;
+        }
+        list = word + len;
+    }
+
+    return mask;
+}
+
+static struct vfile_buf *renderTrace(void) {
+    unsigned int mask = __atomic_load_n(&trace_mask, __ATOMIC_RELAXED);
+    struct vfile_buf *out = xmalloc(sizeof(struct vfile_buf) + TRACE_OPS * 16);
+    if (out == NULL)
+        return NULL;
+
+    out->size = 0;
+    for (int op = 0; op < TRACE_OPS; op++)
+        out->size += sprintf(out->data + out->size, "%s\t%s\n", trace_names[op],
+                             mask & (1u << op) ? "on" : "off");
+
+    return out;
+}
+
+static int writeTrace(struct vfile_buf **vbuf, const char *buf, size_t size) {
+    (void) vbuf;
+
+    char list[256];
+    if (size >= sizeof(list))
+        return -EINVAL;
+    memcpy(list, buf, size);
+    list[size] = '\0';
+
+    unsigned int mask = parse_trace(list, __atomic_load_n(&trace_mask, __ATOMIC_RELAXED));
+    __atomic_store_n(&trace_mask, mask, __ATOMIC_RELAXED);
+
+    return size;
+}
+
+static const struct vfile_ops trace_file_ops = {
+        .render = renderTrace,
+        .write  = writeTrace,
+};
+
+#define ALLOC_TEXT_MAX 128
+
+/* the lines of /.alloc into buf, which has ALLOC_TEXT_MAX bytes */
+static size_t printAlloc(char *buf) {
+    uint64_t allocs = __atomic_load_n(&alloc_stats.allocs, __ATOMIC_RELAXED);
+    uint64_t frees = __atomic_load_n(&alloc_stats.frees, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&slab.lock);
+    uint64_t objects = slab.live;
+    pthread_mutex_unlock(&slab.lock);
+    return sprintf(buf, "allocs\t%llu\nfrees\t%llu\nlive\t%lld\nslab\t%llu\n",
+                   (unsigned long long) allocs, (unsigned long long) frees,
+                   (long long) (allocs - frees), (unsigned long long) objects);
+}
+
+static struct vfile_buf *renderAlloc(void) {
+    struct vfile_buf *out = xmalloc(sizeof(struct vfile_buf) + ALLOC_TEXT_MAX);
+    if (out == NULL)
+        return NULL;
+
+    out->size = printAlloc(out->data);
+    return out;
+}
+
+static const struct vfile_ops alloc_file_ops = {
+        .render = renderAlloc,
+};
+
+/*
+ * Operation statistics (/.stats)
+ *
+ * Every callback is timed and counted by the thread that runs it, in a
+ * block of counters only that thread writes, so counting takes two clock
+ * reads and a few stores and no lock. /.stats adds the blocks up. A thread
+ * hands its block back when it exits and the next new thread counts on in
+ * it, so there are never more blocks than threads at once and the totals
+ * never go down.
+ *
+ * Latencies go in a log2 histogram: bucket i counts the calls that took
+ * [2^i, 2^(i+1)) ns. A read that waits (-o blocking_read) is timed until
+ * the callback returns, not until the writer answers it.
+ */
+#define STATS_BUCKETS 40
+
+struct op_stats {
+    uint64_t count;
+    uint64_t ns;
+    uint64_t hist[STATS_BUCKETS];
+};
+
+struct thread_stats {
+    struct thread_stats *next;
+    int idle;                       /* its thread is gone, under stats.lock */
+    struct op_stats ops[TRACE_OPS]; /* written by its thread only, atomic */
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_once_t once;
+    pthread_key_t key;
+    struct thread_stats *threads;
+    size_t nr_threads;
+} stats = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .once = PTHREAD_ONCE_INIT,
+};
+
+static __thread struct thread_stats *my_stats;
+
+static void release_stats(void *block) {
+    pthread_mutex_lock(&stats.lock);
+    ((struct thread_stats *) block)->idle = 1;
+    pthread_mutex_unlock(&stats.lock);
+}
+
+static void init_stats(void) {
+    pthread_key_create(&stats.key, release_stats);
+}
+
+/* the calling thread's block, NULL when there is no memory for one */
+static struct thread_stats *get_stats(void) {
+    if (my_stats != NULL)
+        return my_stats;
+
+    pthread_once(&stats.once, init_stats);
+    pthread_mutex_lock(&stats.lock);
+    struct thread_stats *block = stats.threads;
+    while (block != NULL && !block->idle)
+        block = block->next;
+    if (block == NULL && (block = xcalloc(1, sizeof(struct thread_stats))) != NULL) {
+        block->next = stats.threads;
+        stats.threads = block;
+        stats.nr_threads++;
+    }
+    if (block != NULL)
+        block->idle = 0;
+    pthread_mutex_unlock(&stats.lock);
+
+    if (block != NULL)
+        pthread_setspecific(stats.key, block);
+    my_stats = block;
+    return block;
+}
+
+static uint64_t clock_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void count_op(int op, uint64_t start) {
+    struct thread_stats *block = get_stats();
+    if (block == NULL)
+        return;
+
+    uint64_t ns = clock_ns() - start;
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= STATS_BUCKETS)
+        bucket = STATS_BUCKETS - 1;
+
+    /* no other thread writes these, a plain increment stored atomically is enough */
+    struct op_stats *s = &block->ops[op];
+    __atomic_store_n(&s->count, s->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->ns, s->ns + ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->hist[bucket], s->hist[bucket] + 1, __ATOMIC_RELAXED);
+}
+
+#define timed(op, call) \
+    do { uint64_t start = clock_ns(); call; count_op(op, start); } while (0)
+
+/*
+ * One "name\tvalue" per line: the usage of the tree, the lines of /.alloc,
+ * then op.count, op.ns (in total) and op.hist (the buckets from 0, up to
+ * the last one that is not empty) for each operation.
+ */
+#define STATS_LINE_MAX 48
+
+static struct vfile_buf *renderStats(void) {
+    struct op_stats sum[TRACE_OPS];
+    memset(sum, 0, sizeof(sum));
+
+    pthread_mutex_lock(&stats.lock);
+    size_t nr_threads = stats.nr_threads;
+    for (struct thread_stats *block = stats.threads; block != NULL; block = block->next)
+        for (int op = 0; op < TRACE_OPS; op++) {
+            struct op_stats *s = &block->ops[op];
+            sum[op].count += __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+            sum[op].ns += __atomic_load_n(&s->ns, __ATOMIC_RELAXED);
+            for (int i = 0; i < STATS_BUCKETS; i++)
+                sum[op].hist[i] += __atomic_load_n(&s->hist[i], __ATOMIC_RELAXED);
+        }
+    pthread_mutex_unlock(&stats.lock);
+
+    size_t max = 8 * STATS_LINE_MAX + ALLOC_TEXT_MAX +
+                 TRACE_OPS * (3 * STATS_LINE_MAX + STATS_BUCKETS * 21);
+    struct vfile_buf *out = xmalloc(sizeof(struct vfile_buf) + max);
+    if (out == NULL)
+        return NULL;
+
+    char *p = out->data;
+    p += sprintf(p, "nodes\t%zu\nconversations\t%zu\ncontent\t%zu\nthreads\t%zu\n",
+                 __atomic_load_n(&usage.nodes, __ATOMIC_RELAXED),
+                 __atomic_load_n(&usage.convs, __ATOMIC_RELAXED),
+                 __atomic_load_n(&usage.content, __ATOMIC_RELAXED), nr_threads);
+    p += printAlloc(p);
+    /* init runs once, before any request */
+    for (int op = TRACE_INIT + 1; op < TRACE_OPS; op++) {
+        int last = STATS_BUCKETS - 1;
+        while (last > 0 && sum[op].hist[last] == 0)
+            last--;
+        p += sprintf(p, "%s.count\t%llu\n%s.ns\t%llu\n%s.hist\t", trace_names[op],
+                     (unsigned long long) sum[op].count, trace_names[op],
+                     (unsigned long long) sum[op].ns, trace_names[op]);
+        for (int i = 0; i <= last; i++)
+            p += sprintf(p, i ? " %llu" : "%llu", (unsigned long long) sum[op].hist[i]);
+        *p++ = '\n';
+    }
+    out->size = p - out->data;
+
+    return out;
+}
+
+static const struct vfile_ops stats_file_ops = {
+        .render = renderStats,
+};
+
+
+/*
+ * Command line options
+ */
+static struct options {
+    unsigned int log_lines;
+    const char *trace;
+    int cache;
+    unsigned int cache_timeout;
+    const char *journal;
+    unsigned int compact;
+    unsigned int max_memory;
+    int blocking_read;
+    int splice;
+    int framed;
+    unsigned int retain_size;
+    unsigned int retain_messages;
+    unsigned int retain_age;
+    const char *cluster;
+    unsigned int node;
+} options;
+
+#define OPTION(t, p)                           \
+    { t, offsetof(struct options, p), 1 }
+static const struct fuse_opt option_spec[] = {
+        OPTION("log_lines=%u", log_lines),
+        OPTION("trace=%s", trace),
+        OPTION("cache", cache),
+        OPTION("cache_timeout=%u", cache_timeout),
+        OPTION("journal=%s", journal),
+        OPTION("compact=%u", compact),
+        OPTION("max_memory=%u", max_memory),
+        OPTION("blocking_read", blocking_read),
+        OPTION("splice", splice),
+        OPTION("framed", framed),
+        OPTION("retain_size=%u", retain_size),
+        OPTION("retain_messages=%u", retain_messages),
+        OPTION("retain_age=%u", retain_age),
+        OPTION("cluster=%s", cluster),
+        OPTION("node=%u", node),
+        FUSE_OPT_END
+};
+
+/*
+ * "/a/b" -> "/b/a", written into res (the result is as long as path).
+ * Returns -1 when path is not of the form "/a/b" or res is too small.
+ */
+static int reverse_path(const char *path, char *res, size_t size) {
+    const char *pos = NULL;
+    int cnt = 0;
+    for (const char *cur = path; *cur != '\0'; cur++) {
+        if (*cur != '/')
+            continue;
+        if (cnt == 0)
+            cnt++;
+        else {
+            pos = cur;
+            break;
+        }
+    }
+    if (pos == NULL || strlen(path) >= size)
+        return -1;
+
+    int idx = 0;
+    for (int cur = pos - path; path[cur] != '\0'; cur++, idx++)
+        res[idx] = path[cur];
+    res[idx++] = '/';
+    for (int cur = 1; path[cur] != '/'; cur++, idx++)
+        res[idx] = path[cur];
+    res[idx] = '\0';
+
+    return 0;
+}
+
+/*
+ * Journal (-o journal=DIR)
+ *
+ * Every change is appended to DIR/journal.<gen> as one record and replayed
+ * in order at startup, after the snapshot (see below) if there is one.
+ * Records are staged in memory under journal.lock and a caller then
+ * waits for its own record to be on disk. Whoever waits while no flush is
+ * running writes out everything staged so far with one fdatasync, so
+ * concurrent writers share the cost of a sync (group commit).
+ *
+ * A record is a journal_rec header followed by the path and the data. The
+ * checksum covers everything after it, so a torn tail is detected and cut
+ * off at replay.
+ */
+#define JOURNAL_MKDIR 1
+#define JOURNAL_CREATE 2
+#define JOURNAL_WRITE 3
+#define JOURNAL_UNLINK 4
+#define JOURNAL_RMDIR 5
+#define JOURNAL_DROP 6              /* retention: offset is the new start */
+#define JOURNAL_RETAIN 7            /* a conversation's own limits, data is a struct retention */
+
+struct journal_rec {
+    uint32_t sum;
+    uint32_t type;
+    uint32_t path_len;
+    uint32_t data_len;
+    uint64_t offset;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t flushed;
+    int on;                         /* set once replay is done */
+    const char *dir;
+    uint64_t gen;                   /* of the file fd appends to */
+    int fd;
+    char *buf, *spare;              /* staged records, the flusher's copy */
+    size_t len, max, spare_max;
+    uint64_t appended, durable;     /* bytes staged / synced so far */
+    uint64_t rotated;               /* appended when gen last changed */
+    int flushing;
+    int error;                      /* sticky, once the disk failed us */
+} journal = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .flushed = PTHREAD_COND_INITIALIZER,
+        .fd = -1,
+};
+
+#define journal_on() (journal.on)
+
+static int journal_path(char *buf, size_t size, uint64_t gen) {
+    int len = snprintf(buf, size, "%s/journal.%llu", journal.dir, (unsigned long long) gen);
+
+    return len < 0 || (size_t) len >= size ? -ENAMETOOLONG : 0;
+}
+
+/* FNV-1a over (len bytes at buf) continuing from sum */
+static uint32_t journal_sum(uint32_t sum, const void *buf, size_t len) {
+    const unsigned char *pos = buf;
+
+    while (len-- > 0) {
+        sum ^= *pos++;
+        sum *= 16777619u;
+    }
+    return sum;
+}
+
+/*
+ * Stage one record, *lsn is what to hand to journal_sync. Changes to the
+ * same conversation must be staged under its lock, so the journal keeps
+ * the order in which they were applied. data is in memory buffers, like
+ * the chunks an append was copied into.
+ */
+static int journal_append_bufv(uint32_t type, const char *path, const struct fuse_bufvec *data,
+                               off_t offset, uint64_t *lsn) {
+    *lsn = 0;
+    if (!journal_on())
+        return 0;
+
+    size_t size = fuse_buf_size(data);
+    struct journal_rec rec = {
+            .type = type,
+            .path_len = strlen(path),
+            .data_len = size,
+            .offset = offset,
+    };
+    size_t need = sizeof(rec) + rec.path_len + size;
+
+    rec.sum = journal_sum(2166136261u, &rec.type, sizeof(rec) - sizeof(rec.sum));
+    rec.sum = journal_sum(rec.sum, path, rec.path_len);
+    for (size_t i = 0; i < data->count; i++)
+        rec.sum = journal_sum(rec.sum, data->buf[i].mem, data->buf[i].size);
+
+    pthread_mutex_lock(&journal.lock);
+    if (journal.len + need > journal.max) {
+        size_t max = journal.max ? journal.max : 64 * 1024;
+        while (journal.len + need > max)
+            max *= 2;
+        char *buf = xrealloc(journal.buf, max);
+        if (buf == NULL) {
+            pthread_mutex_unlock(&journal.lock);
+            return -ENOMEM;
+        }
+        journal.buf = buf;
+        journal.max = max;
+    }
+    char *pos = journal.buf + journal.len;
+    memcpy(pos, &rec, sizeof(rec));
+    memcpy(pos + sizeof(rec), path, rec.path_len);
+    pos += sizeof(rec) + rec.path_len;
+    for (size_t i = 0; i < data->count; i++) {
+        memcpy(pos, data->buf[i].mem, data->buf[i].size);
+        pos += data->buf[i].size;
+    }
+    journal.len += need;
+    journal.appended += need;
+    *lsn = journal.appended;
+    pthread_mutex_unlock(&journal.lock);
+
+    return 0;
+}
+
+/* the same from one buffer */
+static int journal_append(uint32_t type, const char *path, const char *data, size_t size,
+                          off_t offset, uint64_t *lsn) {
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+
+    bufv.buf[0].mem = (void *) data;
+    return journal_append_bufv(type, path, &bufv, offset, lsn);
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t done = write(fd, buf, len);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done < 0)
+            return -errno;
+        buf += done;
+        len -= done;
+    }
+    return 0;
+}
+
+/* compaction, set up below */
+#define COMPACT_DEFAULT 64          /* MiB of journal between snapshots */
+
+static struct {
+    pthread_cond_t wake;            /* waited on under journal.lock */
+    uint64_t threshold;             /* bytes, 0 never compacts */
+    int stop;
+    int running;
+    pthread_t thread;
+} compact = {
+        .wake = PTHREAD_COND_INITIALIZER,
+};
+
+/* wait until everything up to lsn is on disk, flushing if nobody else is */
+static int journal_sync(uint64_t lsn) {
+    if (lsn == 0)
+        return 0;
+
+    pthread_mutex_lock(&journal.lock);
+    while (journal.durable < lsn && !journal.error) {
+        if (journal.flushing) {
+            pthread_cond_wait(&journal.flushed, &journal.lock);
+            continue;
+        }
+
+        /* swap buffers, so writers keep staging while we are on disk */
+        char *buf = journal.buf;
+        size_t len = journal.len, max = journal.max;
+        uint64_t target = journal.appended;
+        journal.buf = journal.spare;
+        journal.max = journal.spare_max;
+        journal.len = 0;
+        journal.flushing = 1;
+        int fd = journal.fd;
+        pthread_mutex_unlock(&journal.lock);
+
+        int res = write_all(fd, buf, len);
+        if (res == 0 && fdatasync(fd) != 0)
+            res = -errno;
+
+        pthread_mutex_lock(&journal.lock);
+        journal.spare = buf;
+        journal.spare_max = max;
+        journal.flushing = 0;
+        if (res != 0)
+            journal.error = -res;
+        else
+            journal.durable = target;
+        pthread_cond_broadcast(&journal.flushed);
+        if (compact.threshold && journal.durable - journal.rotated >= compact.threshold)
+            pthread_cond_signal(&compact.wake);
+    }
+    int res = journal.durable >= lsn ? 0 : -EIO;
+    pthread_mutex_unlock(&journal.lock);
+
+    return res;
+}
+
+/*
+ * Cluster (-o cluster=FILE,node=N)
+ *
+ * Several daidai share one namespace: FILE lists every node as "host
+ * port", one per line and in the same order on all of them, and N is
+ * this one's line. Each bot lives on the node its name hashes to, and a
+ * node only holds its own bots, so lookups, readdir and getattr never
+ * leave it. /a/b where b lives elsewhere is a conversation of its own
+ * here, and what is written to it is delivered to /b/a on b's node,
+ * which makes it when it is missing (and drops it when there is no bot
+ * b yet) and sends its writes back the same way: each side holds the
+ * whole conversation, in the order it got each part. Groups only have
+ * members on their own node.
+ *
+ * Deliveries are records like the journal's, queued for the other node
+ * and sent by one thread per node over a connection kept open, as many
+ * at a time as are queued; writes only wait for them when too much is
+ * queued for that node already. A record stays queued
+ * until the other node acknowledges its number, so after a broken
+ * connection the rest is sent again, and a node skips the numbers it has
+ * applied already. What is queued when the process exits is lost.
+ */
+#define CLUSTER_NODES_MAX 64
+#define CLUSTER_QUEUE_MAX (64 << 20)    /* bytes queued for one node before writes wait */
+#define CLUSTER_RETRY_MS 1000
+#define CLUSTER_ACK_MS 100
+#define CLUSTER_MAGIC "daidaic1"
+
+/* what a connection starts with, answered with the last number applied */
+struct cluster_hello {
+    char magic[8];
+    uint32_t node;
+    uint32_t pad;
+    uint64_t boot;                  /* numbers start over when it changes */
+};
+
+/* the records for one other node, sent in the order of their numbers (rec.offset) */
+struct cluster_link {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;            /* records queued, or stop */
+    pthread_cond_t room;            /* records acknowledged, or stop */
+    char *host, *port;
+    char *buf;                      /* [head, len) not acknowledged yet */
+    size_t head, len, max;
+    size_t sent;                    /* up to where the connection has them */
+    uint64_t seq;                   /* of the last one queued */
+    int fd;                         /* the sender's, -1 while disconnected */
+    int stop;
+    int running;
+    pthread_t thread;
+};
+
+static struct {
+    size_t nr_nodes;                /* 0 when not clustered */
+    unsigned int self;
+    uint64_t boot;
+    int on;                         /* set once the senders run, replay queues nothing */
+    struct cluster_link links[CLUSTER_NODES_MAX];
+
+    /* receiving, set up below */
+    pthread_mutex_t lock;           /* conns */
+    struct cluster_conn *conns;
+    int listen_fd;
+    int listening;
+    pthread_t thread;
+    struct {
+        pthread_mutex_t lock;       /* one connection applies at a time */
+        uint64_t boot;
+        uint64_t applied;
+    } from[CLUSTER_NODES_MAX];
+} cluster = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .listen_fd = -1,
+};
+
+/* the node bot name lives on */
+static unsigned int shard_of(const char *name, size_t len) {
+    return journal_sum(2166136261u, name, len) % cluster.nr_nodes;
+}
+
+/* the other node holding path's bot, -1 when it is this one */
+static int remote_node(const char *path) {
+    if (cluster.nr_nodes == 0 || path[0] != '/')
+        return -1;
+
+    const char *end = strchr(path + 1, '/');
+    unsigned int node = shard_of(path + 1, end ? (size_t) (end - path - 1) : strlen(path + 1));
+    return node == cluster.self ? -1 : (int) node;
+}
+
+/* the other node holding the other end of conversation path, -1 when it is this one */
+static int peer_node(const char *path) {
+    return is_conversation(path) ? remote_node(strrchr(path, '/')) : -1;
+}
+
+/*
+ * Queue one record for node, numbered in the order queued. Deliveries
+ * to one conversation are queued under its lock, like its journal
+ * records, so the other side gets them in the order they were applied.
+ */
+static int cluster_queue(int node, uint32_t type, const char *path, const struct fuse_bufvec *data) {
+    if (!cluster.on || node < 0)
+        return 0;
+
+    struct cluster_link *link = &cluster.links[node];
+    size_t size = data ? fuse_buf_size(data) : 0;
+    struct journal_rec rec = {
+            .type = type,
+            .path_len = strlen(path),
+            .data_len = size,
+    };
+    size_t need = sizeof(rec) + rec.path_len + size;
+
+    pthread_mutex_lock(&link->lock);
+    /* slide the rest down once at least half was acknowledged */
+    if (link->len + need > link->max && link->head >= link->len - link->head) {
+        memmove(link->buf, link->buf + link->head, link->len - link->head);
+        link->len -= link->head;
+        link->sent -= link->head;
+        link->head = 0;
+    }
+    if (link->len + need > link->max) {
+        size_t max = link->max ? link->max : 64 * 1024;
+        while (link->len + need > max)
+            max *= 2;
+        char *buf = xrealloc(link->buf, max);
+        if (buf == NULL) {
+            pthread_mutex_unlock(&link->lock);
+            return -ENOMEM;
+        }
+        link->buf = buf;
+        link->max = max;
+    }
+    rec.offset = ++link->seq;
+    rec.sum = journal_sum(2166136261u, &rec.type, sizeof(rec) - sizeof(rec.sum));
+    rec.sum = journal_sum(rec.sum, path, rec.path_len);
+    for (size_t i = 0; data && i < data->count; i++)
+        rec.sum = journal_sum(rec.sum, data->buf[i].mem, data->buf[i].size);
+
+    char *pos = link->buf + link->len;
+    memcpy(pos, &rec, sizeof(rec));
+    memcpy(pos + sizeof(rec), path, rec.path_len);
+    pos += sizeof(rec) + rec.path_len;
+    for (size_t i = 0; data && i < data->count; i++) {
+        memcpy(pos, data->buf[i].mem, data->buf[i].size);
+        pos += data->buf[i].size;
+    }
+    link->len += need;
+    pthread_cond_signal(&link->wake);
+    pthread_mutex_unlock(&link->lock);
+
+    return 0;
+}
+
+/* hold a write back while node has too much queued, so a slow node costs memory only up to a bound */
+static void cluster_wait_room(int node) {
+    if (!cluster.on || node < 0)
+        return;
+
+    struct cluster_link *link = &cluster.links[node];
+    pthread_mutex_lock(&link->lock);
+    while (link->len - link->head >= CLUSTER_QUEUE_MAX && !link->stop)
+        pthread_cond_wait(&link->room, &link->lock);
+    pthread_mutex_unlock(&link->lock);
+}
+
+/* deliver data written to conv to the other end, callers hold conv->lock */
+static int forward_write(struct conversation *conv, const struct fuse_bufvec *data) {
+    char rev_path[PATH_MAX];
+
+    if (reverse_path(conv->ends->path, rev_path, sizeof(rev_path)) != 0)
+        return 0;
+    return cluster_queue(conv->shard, JOURNAL_WRITE, rev_path, data);
+}
+
+/* forget the records up to applied, callers hold link->lock */
+static void cluster_acked(struct cluster_link *link, uint64_t applied) {
+    size_t head = link->head;
+
+    while (head < link->len) {
+        struct journal_rec rec;
+        memcpy(&rec, link->buf + head, sizeof(rec));
+        if (rec.offset > applied)
+            break;
+        head += sizeof(rec) + rec.path_len + rec.data_len;
+    }
+    if (head != link->head)
+        pthread_cond_broadcast(&link->room);
+    link->head = head;
+    if (link->sent < head)
+        link->sent = head;
+}
+
+/* wait on cond for up to ms, or until it is signalled */
+static void cond_wait_ms(pthread_cond_t *cond, pthread_mutex_t *lock, long ms) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += ms % 1000 * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(cond, lock, &ts);
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    char *pos = buf;
+
+    while (len > 0) {
+        ssize_t done = read(fd, pos, len);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return done < 0 ? -errno : -ECONNRESET;
+        pos += done;
+        len -= done;
+    }
+    return 0;
+}
+
+/* a connection to link's node, past the hello; *applied is what it has of ours */
+static int cluster_connect(struct cluster_link *link, uint64_t *applied) {
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM}, *res, *ai;
+    int fd = -1;
+
+    if (getaddrinfo(link->host, link->port, &hints, &res) != 0)
+        return -1;
+    /* a node that is down or stuck must not hold up stopping for long */
+    struct timeval timeout = {.tv_sec = CLUSTER_RETRY_MS / 1000, .tv_usec = CLUSTER_RETRY_MS % 1000 * 1000};
+    for (ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd < 0)
+        return -1;
+
+    struct cluster_hello hello = {.node = cluster.self, .boot = cluster.boot};
+    memcpy(hello.magic, CLUSTER_MAGIC, sizeof(hello.magic));
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (write_all(fd, (const char *) &hello, sizeof(hello)) != 0 ||
+        read_all(fd, applied, sizeof(*applied)) != 0) {
+        close(fd);
+        return -1;
+    }
+    /* the records then wait as long as the other node takes to read them */
+    timeout.tv_sec = timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+/*
+ * Send what is queued for one node, everything there is in one write,
+ * reading the acknowledgements that came back meanwhile in between. The
+ * records are copied out so appends can keep queueing while we send.
+ */
+static void *cluster_sender(void *arg) {
+    struct cluster_link *link = arg;
+    char *spare = NULL;
+    size_t spare_max = 0;
+    uint64_t ack;                   /* may come in pieces */
+    size_t ack_len = 0;
+
+    pthread_mutex_lock(&link->lock);
+    while (!link->stop) {
+        if (link->fd < 0) {
+            uint64_t applied = 0;
+            pthread_mutex_unlock(&link->lock);
+            int fd = cluster_connect(link, &applied);
+            pthread_mutex_lock(&link->lock);
+            if (fd < 0) {
+                if (!link->stop)
+                    cond_wait_ms(&link->wake, &link->lock, CLUSTER_RETRY_MS);
+                continue;
+            }
+            link->fd = fd;
+            link->sent = link->head;
+            ack_len = 0;
+            cluster_acked(link, applied);
+            continue;
+        }
+
+        ssize_t got;
+        while ((got = recv(link->fd, (char *) &ack + ack_len, sizeof(ack) - ack_len, MSG_DONTWAIT)) > 0)
+            if ((ack_len += got) == sizeof(ack)) {
+                cluster_acked(link, ack);
+                ack_len = 0;
+            }
+        if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            close(link->fd);
+            link->fd = -1;
+            continue;
+        }
+        if (link->sent == link->len) {
+            /* acknowledgements only come in while something is unacknowledged */
+            if (link->head < link->len)
+                cond_wait_ms(&link->wake, &link->lock, CLUSTER_ACK_MS);
+            else
+                pthread_cond_wait(&link->wake, &link->lock);
+            continue;
+        }
+
+        size_t len = link->len - link->sent;
+        if (len > spare_max) {
+            char *grown = xrealloc(spare, len);
+            if (grown == NULL) {
+                cond_wait_ms(&link->wake, &link->lock, CLUSTER_RETRY_MS);
+                continue;
+            }
+            spare = grown;
+            spare_max = len;
+        }
+        memcpy(spare, link->buf + link->sent, len);
+        int fd = link->fd;
+        pthread_mutex_unlock(&link->lock);
+        int res = write_all(fd, spare, len);
+        pthread_mutex_lock(&link->lock);
+        if (res != 0) {
+            close(link->fd);
+            link->fd = -1;
+        } else
+            link->sent += len;
+    }
+    if (link->fd >= 0)
+        close(link->fd);
+    link->fd = -1;
+    pthread_mutex_unlock(&link->lock);
+    xfree(spare);
+
+    return NULL;
+}
+
+/*
+ * Snapshot (DIR/snapshot)
+ *
+ * Compaction writes the whole tree into one flat image that is mapped at
+ * startup and read in place: a conversation's bytes stay in the mapping
+ * (and the page cache) until they are overwritten, so loading costs one
+ * pass over the nodes, not over the content.
+ *
+ *   snap_header | snap_conv[nr_convs] | snap_node[nr_nodes] | paths | content
+ *
+ * Offsets are from the start of the file; each conversation's content,
+ * the bytes from start kept by retention, is followed by its message ends
+ * (-o framed), if it has any. Images written before framing ("daidai01")
+ * have no marks in snap_conv, those written before retention ("daidai02")
+ * neither start nor limits.
+ *
+ * The journal is switched to a new generation first and the snapshot is
+ * taken after that, so it holds everything in the old generations and,
+ * fuzzily, some of the new one.
+ * Replaying the new generation on top still gives the right state: writes
+ * overwrite in order, and entries that already exist, or are already gone,
+ * are skipped. The snapshot is renamed into place before old generations
+ * are deleted, so a crash at any point leaves a snapshot and the journals
+ * that follow it.
+ */
+#define SNAPSHOT_MAGIC "daidai03"
+#define SNAPSHOT_MAGIC_V2 "daidai02"
+#define SNAPSHOT_MAGIC_V1 "daidai01"
+#define SNAP_CONV_V2 (4 * sizeof(uint64_t))     /* up to nr_marks */
+#define SNAP_CONV_V1 (2 * sizeof(uint64_t))     /* offset and size only */
+
+struct snap_header {
+    char magic[8];
+    uint64_t gen;                   /* first journal to replay on top */
+    uint64_t nr_convs;
+    uint64_t nr_nodes;
+};
+
+struct snap_conv {
+    uint64_t offset;
+    uint64_t size;                  /* the end, the image holds [start, size) */
+    uint64_t marks;                 /* offset of nr_marks uint64_t */
+    uint64_t nr_marks;
+    uint64_t start;
+    struct retention retain;
+};
+
+struct snap_node {
+    uint32_t type;
+    uint32_t path_len;
+    uint64_t path;
+    int64_t conv;                   /* index into snap_conv, -1 if none */
+};
+
+/* start journal.<gen + 1>, everything staged so far goes to the old one */
+static int journal_rotate(void) {
+    char path[PATH_MAX];
+    int res = journal_path(path, sizeof(path), journal.gen + 1);
+    if (res != 0)
+        return res;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0)
+        return -errno;
+
+    pthread_mutex_lock(&journal.lock);
+    while (journal.flushing)
+        pthread_cond_wait(&journal.flushed, &journal.lock);
+    res = write_all(journal.fd, journal.buf, journal.len);
+    if (res == 0 && fdatasync(journal.fd) != 0)
+        res = -errno;
+    if (res == 0) {
+        close(journal.fd);
+        journal.fd = fd;
+        journal.gen++;
+        journal.len = 0;
+        journal.durable = journal.appended;
+        journal.rotated = journal.appended;
+        pthread_cond_broadcast(&journal.flushed);
+    }
+    pthread_mutex_unlock(&journal.lock);
+
+    if (res != 0) {
+        close(fd);
+        unlink(path);
+    }
+    return res;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, off_t offset) {
+    const char *pos = buf;
+
+    while (len > 0) {
+        ssize_t done = pwrite(fd, pos, len, offset);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done < 0)
+            return -errno;
+        pos += done;
+        offset += done;
+        len -= done;
+    }
+    return 0;
+}
+
+static int fsync_dir(const char *dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return -errno;
+    int res = fsync(fd) != 0 ? -errno : 0;
+    close(fd);
+
+    return res;
+}
+
+/* copy the conversations into the image, one chunk at a time under their locks */
+static int write_contents(int fd, struct conversation **convs, struct snap_conv *sconvs,
+                          size_t nr_convs) {
+    char *buf = xmalloc(CHUNK_SIZE);
+    int res = buf ? 0 : -ENOMEM;
+
+    for (size_t i = 0; res == 0 && i < nr_convs; i++) {
+        /* what retention dropped meanwhile is left a hole, the journal drops it again */
+        size_t kept = sconvs[i].size - sconvs[i].start;
+        for (size_t done = 0; res == 0 && done < kept;) {
+            size_t len = kept - done < CHUNK_SIZE ? kept - done : CHUNK_SIZE;
+            pthread_rwlock_rdlock(&convs[i]->lock);
+            size_t got = conv_read(convs[i], buf, len, sconvs[i].start + done);
+            pthread_rwlock_unlock(&convs[i]->lock);
+            res = pwrite_all(fd, buf, got, sconvs[i].offset + done);
+            done += len;
+        }
+        /*
+         * the index may be reallocated meanwhile, copy it out a piece at a
+         * time; ends dropped since are written as start, which load skips
+         */
+        for (size_t done = 0; res == 0 && done < sconvs[i].nr_marks;) {
+            size_t nr = sconvs[i].nr_marks - done;
+            if (nr > CHUNK_SIZE / sizeof(uint64_t))
+                nr = CHUNK_SIZE / sizeof(uint64_t);
+            pthread_rwlock_rdlock(&convs[i]->lock);
+            for (size_t k = 0; k < nr; k++) {
+                uint64_t at = convs[i]->snap_marks + done + k;
+                ((uint64_t *) buf)[k] = at < convs[i]->dropped_marks ? sconvs[i].start :
+                                        mark_at(convs[i], at - convs[i]->dropped_marks);
+            }
+            pthread_rwlock_unlock(&convs[i]->lock);
+            res = pwrite_all(fd, buf, nr * sizeof(uint64_t), sconvs[i].marks + done * sizeof(uint64_t));
+            done += nr;
+        }
+    }
+    xfree(buf);
+
+    return res;
+}
+
+/* the nodes and conversations a snapshot is made of, see write_snapshot */
+struct snap_list {
+    uint64_t gen;
+    struct snap_node *snodes;
+    struct conversation **convs;
+    size_t nr_nodes, nr_convs, max_nodes;
+    char *paths;
+    size_t paths_len, paths_max;
+};
+
+static int snap_add(struct snap_list *list, struct daidai_node *node) {
+    size_t len = strlen(node->path);
+
+    if (list->nr_nodes == list->max_nodes) {
+        size_t max = list->max_nodes ? list->max_nodes * 2 : 256;
+        struct snap_node *snodes = xrealloc(list->snodes, max * sizeof(struct snap_node));
+        if (snodes == NULL)
+            return -ENOMEM;
+        list->snodes = snodes;
+        struct conversation **convs = xrealloc(list->convs, max * sizeof(struct conversation *));
+        if (convs == NULL)
+            return -ENOMEM;
+        list->convs = convs;
+        list->max_nodes = max;
+    }
+    if (list->paths_len + len > list->paths_max) {
+        size_t max = list->paths_max ? list->paths_max : 4096;
+        while (list->paths_len + len > max)
+            max *= 2;
+        char *grown = xrealloc(list->paths, max);
+        if (grown == NULL)
+            return -ENOMEM;
+        list->paths = grown;
+        list->paths_max = max;
+    }
+    memcpy(list->paths + list->paths_len, node->path, len);
+
+    struct snap_node *snode = &list->snodes[list->nr_nodes++];
+    snode->type = node->type;
+    snode->path_len = len;
+    snode->path = list->paths_len;
+    snode->conv = -1;
+    list->paths_len += len;
+
+    struct conversation *conv = node->conv;
+    if (conv == NULL)
+        return 0;
+    if (conv->snap_gen != list->gen) {
+        conv->snap_gen = list->gen;
+        conv->snap_id = list->nr_convs;
+        list->convs[list->nr_convs++] = get_conv(conv);
+    }
+    snode->conv = conv->snap_id;
+    return 0;
+}
+
+/* dir's subtree, each directory under its own lock, parents first */
+static int snap_walk(struct snap_list *list, struct daidai_node *dir) {
+    int res = 0;
+
+    pthread_rwlock_rdlock(dir->lock);
+    for (struct daidai_node *node = child_of(rb_first(&dir->children));
+         res == 0 && node != NULL; node = child_of(rb_next(&node->child_node))) {
+        if (node->type == Virtual)
+            continue;
+        res = snap_add(list, node);
+        if (res == 0 && node->type == Directory)
+            res = snap_walk(list, node);
+    }
+    pthread_rwlock_unlock(dir->lock);
+
+    return res;
+}
+
+/*
+ * The whole tree, under the bot index for reading. The limbo is listed
+ * first and its entries pinned, as limbo_lock must not be held while
+ * taking a directory's lock: one adopted meanwhile is then found by the
+ * walk, and the copy listed twice is dropped when the snapshot is loaded.
+ */
+static int snap_tree(struct snap_list *list) {
+    struct daidai_node **nodes = NULL;
+    size_t nr_nodes = 0, max_nodes = 0;
+    int res = 0;
+
+    pthread_mutex_lock(&limbo_lock);
+    for (struct daidai_node *node = child_of(rb_first(&limbo)); node != NULL;
+         node = child_of(rb_next(&node->child_node))) {
+        if (nr_nodes == max_nodes) {
+            size_t max = max_nodes ? max_nodes * 2 : 16;
+            struct daidai_node **grown = xrealloc(nodes, max * sizeof(struct daidai_node *));
+            if (grown == NULL) {
+                res = -ENOMEM;
+                break;
+            }
+            nodes = grown;
+            max_nodes = max;
+        }
+        __atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+        nodes[nr_nodes++] = node;
+    }
+    pthread_mutex_unlock(&limbo_lock);
+
+    pthread_rwlock_rdlock(root_node->lock);
+    if (res == 0)
+        res = snap_walk(list, root_node);
+    for (size_t i = 0; i < nr_nodes; i++) {
+        if (res == 0)
+            res = snap_add(list, nodes[i]);
+        if (res == 0 && nodes[i]->type == Directory)
+            res = snap_walk(list, nodes[i]);
+        put_node(nodes[i], 1);
+    }
+    pthread_rwlock_unlock(root_node->lock);
+    xfree(nodes);
+
+    return res;
+}
+
+/*
+ * Called from the compaction thread only. The tree is walked once, each
+ * directory under its lock for reading, pinning the conversations; their
+ * content is copied after the locks are dropped.
+ */
+static int write_snapshot(void) {
+    int res = journal_rotate();
+    if (res != 0)
+        return res;
+    uint64_t gen = journal.gen;
+
+    struct snap_list list = { .gen = gen };
+    res = snap_tree(&list);
+    struct snap_node *snodes = list.snodes;
+    struct conversation **convs = list.convs;
+    char *paths = list.paths;
+    size_t nr_nodes = list.nr_nodes, nr_convs = list.nr_convs, paths_len = list.paths_len;
+
+    /* lay the file out, content sizes are taken now */
+    struct snap_conv *sconvs = xmalloc((nr_convs ? nr_convs : 1) * sizeof(struct snap_conv));
+    if (res == 0 && sconvs == NULL)
+        res = -ENOMEM;
+    uint64_t pos = sizeof(struct snap_header) + nr_convs * sizeof(struct snap_conv) +
+                   nr_nodes * sizeof(struct snap_node);
+    for (size_t i = 0; i < nr_nodes; i++)
+        snodes[i].path += pos;
+    pos += paths_len;
+    for (size_t i = 0; res == 0 && i < nr_convs; i++) {
+        pos = (pos + 7) & ~(uint64_t) 7;
+        pthread_rwlock_rdlock(&convs[i]->lock);
+        sconvs[i].size = convs[i]->size;
+        sconvs[i].start = convs[i]->start;
+        sconvs[i].retain = convs[i]->retain;
+        sconvs[i].nr_marks = nr_marks(convs[i]);
+        convs[i]->snap_marks = convs[i]->dropped_marks;
+        pthread_rwlock_unlock(&convs[i]->lock);
+        sconvs[i].offset = pos;
+        pos += sconvs[i].size - sconvs[i].start;
+        pos = (pos + 7) & ~(uint64_t) 7;
+        sconvs[i].marks = pos;
+        pos += sconvs[i].nr_marks * sizeof(uint64_t);
+    }
+
+    char tmp_path[PATH_MAX], snap_path[PATH_MAX];
+    if (res == 0 && (snprintf(tmp_path, sizeof(tmp_path), "%s/snapshot.tmp", journal.dir) >= PATH_MAX ||
+                     snprintf(snap_path, sizeof(snap_path), "%s/snapshot", journal.dir) >= PATH_MAX))
+        res = -ENAMETOOLONG;
+    int fd = res == 0 ? open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (res == 0 && fd < 0)
+        res = -errno;
+
+    if (res == 0) {
+        struct snap_header header = {
+                .gen = gen,
+                .nr_convs = nr_convs,
+                .nr_nodes = nr_nodes,
+        };
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        off_t at = 0;
+        res = pwrite_all(fd, &header, sizeof(header), at);
+        at += sizeof(header);
+        if (res == 0)
+            res = pwrite_all(fd, sconvs, nr_convs * sizeof(struct snap_conv), at);
+        at += nr_convs * sizeof(struct snap_conv);
+        if (res == 0)
+            res = pwrite_all(fd, snodes, nr_nodes * sizeof(struct snap_node), at);
+        at += nr_nodes * sizeof(struct snap_node);
+        if (res == 0)
+            res = pwrite_all(fd, paths, paths_len, at);
+    }
+    if (res == 0)
+        res = write_contents(fd, convs, sconvs, nr_convs);
+    /* the layout may end in padding or an empty conversation that nothing was written to */
+    if (res == 0 && ftruncate(fd, pos) != 0)
+        res = -errno;
+    if (res == 0 && fdatasync(fd) != 0)
+        res = -errno;
+    if (fd >= 0)
+        close(fd);
+    if (res == 0 && rename(tmp_path, snap_path) != 0)
+        res = -errno;
+    if (res == 0)
+        res = fsync_dir(journal.dir);
+    else if (fd >= 0)
+        unlink(tmp_path);
+
+    /* the snapshot covers every older generation now */
+    for (uint64_t old = gen - 1; res == 0 && old > 0; old--) {
+        char path[PATH_MAX];
+        journal_path(path, sizeof(path), old);
+        if (unlink(path) != 0)
+            break;
+    }
+
+    for (size_t i = 0; i < nr_convs; i++)
+        put_conv(convs[i]);
+    xfree(sconvs);
+    xfree(convs);
+    xfree(snodes);
+    xfree(paths);
+
+    return res;
+}
+
+static void *compact_worker(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&journal.lock);
+    while (!compact.stop) {
+        if (journal.durable - journal.rotated < compact.threshold) {
+            pthread_cond_wait(&compact.wake, &journal.lock);
+            continue;
+        }
+        pthread_mutex_unlock(&journal.lock);
+
+        int res = write_snapshot();
+        if (res != 0)
+            fprintf(stderr, "snapshot: %s\n", strerror(-res));
+
+        pthread_mutex_lock(&journal.lock);
+        /* don't retry a failed snapshot before another threshold is written */
+        if (res != 0)
+            journal.rotated = journal.durable;
+    }
+    pthread_mutex_unlock(&journal.lock);
+
+    return NULL;
+}
+
+/*
+ * Map DIR/snapshot, if there is one, and build the tree from it. *gen is
+ * the first journal generation to replay. The mapping is never unmapped
+ * once the tree is built: conversations read from it for as long as they
+ * live. An image that does not check out is unmapped and leaves no tree.
+ */
+static int load_snapshot(const char *dir, uint64_t *gen) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/snapshot", dir) >= (int) sizeof(path))
+        return -ENAMETOOLONG;
+
+    *gen = 1;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -errno;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int res = -errno;
+        close(fd);
+        return res;
+    }
+    size_t size = st.st_size;
+    const char *map = size ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    int res = map != MAP_FAILED ? 0 : size ? -errno : -EINVAL;
+    close(fd);
+    if (res != 0)
+        return res;
+
+    const struct snap_header *header = (const void *) map;
+    size_t conv_size = 0;
+    if (size >= sizeof(*header) && memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0)
+        conv_size = sizeof(struct snap_conv);
+    else if (size >= sizeof(*header) && memcmp(header->magic, SNAPSHOT_MAGIC_V2, sizeof(header->magic)) == 0)
+        conv_size = SNAP_CONV_V2;
+    else if (size >= sizeof(*header) && memcmp(header->magic, SNAPSHOT_MAGIC_V1, sizeof(header->magic)) == 0)
+        conv_size = SNAP_CONV_V1;
+    struct conversation **convs = NULL;
+    if (conv_size == 0 ||
+        header->nr_convs > size / conv_size ||
+        header->nr_nodes > size / sizeof(struct snap_node) ||
+        sizeof(*header) + header->nr_convs * conv_size +
+        header->nr_nodes * sizeof(struct snap_node) > size) {
+        res = -EINVAL;
+        goto out;
+    }
+    const char *sconvs = (const char *) (header + 1);
+    const struct snap_node *snodes = (const void *) (sconvs + header->nr_convs * conv_size);
+
+    /* all the nodes are checked before any is made */
+    for (size_t i = 0; i < header->nr_nodes; i++) {
+        const struct snap_node *snode = &snodes[i];
+        if (snode->path_len >= PATH_MAX || snode->path > size ||
+            snode->path_len > size - snode->path || snode->conv >= (int64_t) header->nr_convs ||
+            (snode->type == File) != (snode->conv >= 0)) {
+            res = -EINVAL;
+            goto out;
+        }
+    }
+
+    convs = xcalloc(header->nr_convs ? header->nr_convs : 1, sizeof(struct conversation *));
+    if (convs == NULL) {
+        res = -ENOMEM;
+        goto out;
+    }
+    time_t load_time = time(NULL);
+    for (size_t i = 0; res == 0 && i < header->nr_convs; i++) {
+        struct snap_conv sconv = {0};
+        memcpy(&sconv, sconvs + i * conv_size, conv_size);
+        if (sconv.start % CHUNK_SIZE || sconv.start > sconv.size || sconv.offset > size ||
+            sconv.size - sconv.start > size - sconv.offset ||
+            (sconv.nr_marks && (sconv.marks % sizeof(uint64_t) || sconv.marks > size ||
+                                sconv.nr_marks > (size - sconv.marks) / sizeof(uint64_t)))) {
+            res = -EINVAL;
+            break;
+        }
+        struct conversation *conv = create_conv();
+        size_t kept = sconv.size - sconv.start;
+        size_t nr_chunks = (kept + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        conv->chunks = nr_chunks ? xcalloc(nr_chunks, sizeof(struct chunk *)) : NULL;
+        conv->stamps = nr_chunks ? xmalloc(nr_chunks * sizeof(time_t)) : NULL;
+        conv->nr_chunks = conv->max_chunks = nr_chunks;
+        conv->base = map + sconv.offset;
+        conv->base_size = kept;
+        conv->start = sconv.start;
+        conv->size = conv->tail = sconv.size;
+        conv->retain = sconv.retain;
+        __atomic_add_fetch(&usage.content, kept, __ATOMIC_RELAXED);
+        conv->base_marks = sconv.nr_marks ? (const uint64_t *) (map + sconv.marks) : NULL;
+        conv->nr_base_marks = sconv.nr_marks;
+        /* ends dropped while the image was written, see write_contents */
+        while (conv->nr_base_marks > 0 && conv->base_marks[0] <= conv->start) {
+            conv->base_marks++;
+            conv->nr_base_marks--;
+        }
+        convs[i] = conv;
+        if (nr_chunks && (conv->chunks == NULL || conv->stamps == NULL)) {
+            conv->nr_chunks = conv->max_chunks = 0;
+            res = -ENOMEM;
+            continue;
+        }
+        /* ages count from the mount for what was saved */
+        for (size_t k = 0; k < nr_chunks; k++)
+            conv->stamps[k] = load_time;
+    }
+
+    for (size_t i = 0; res == 0 && i < header->nr_nodes; i++) {
+        const struct snap_node *snode = &snodes[i];
+        memcpy(path, map + snode->path, snode->path_len);
+        path[snode->path_len] = '\0';
+        if (path[0] != '/')
+            continue;
+
+        struct daidai_node *node = create_node(snode->type, path,
+                                               snode->conv >= 0 ? convs[snode->conv] : NULL);
+        if (node->type == File && peer_node(path) >= 0)
+            node->conv->shard = peer_node(path);
+        if (link_node(node) != 0)
+            free_node(node);
+    }
+
+    if (res == 0)
+        *gen = header->gen;
+
+out:
+    /* without nodes the conversations go here, and nothing reads the mapping any more */
+    for (size_t i = 0; convs != NULL && i < header->nr_convs; i++)
+        if (convs[i] != NULL)
+            put_conv(convs[i]);
+    xfree(convs);
+    if (res != 0)
+        munmap((void *) map, size);
+
+    return res;
+}
+
+/*
+ * Write conv's body to the spill file and free its chunks, callers hold
+ * conv->lock for writing. A slot is allocated with room to double, so a
+ * growing conversation is usually evicted in place, writing only the
+ * chunks it holds; slots are never reused, holes are punched instead.
+ */
+static int evict_conv(struct conversation *conv) {
+    /* appends in flight are copying into the chunks */
+    if (conv->nr_resident == 0 || conv->tail != conv->size)
+        return 0;
+
+    size_t size = conv->size - conv->start;
+    size_t nr_chunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    int in_place = conv->spill_cap >= size && conv->base == evict.map + conv->spill_off;
+    off_t off = conv->spill_off;
+    size_t cap = conv->spill_cap;
+    if (!in_place) {
+        cap = (2 * size + CHUNK_SIZE - 1) / CHUNK_SIZE * CHUNK_SIZE;
+        pthread_mutex_lock(&evict.lock);
+        off = evict.end;
+        if ((uint64_t) off + cap <= SPILL_MAP_SIZE)
+            evict.end += cap;
+        pthread_mutex_unlock(&evict.lock);
+        if ((uint64_t) off + cap > SPILL_MAP_SIZE)
+            return -ENOSPC;
+    }
+
+    for (size_t i = 0; i < nr_chunks; i++) {
+        struct chunk *chunk = conv->chunks[i];
+        if (in_place && chunk == NULL)
+            continue;
+        size_t len = size - i * CHUNK_SIZE < CHUNK_SIZE ? size - i * CHUNK_SIZE : CHUNK_SIZE;
+        const char *data = chunk ? chunk->data : conv->base + i * CHUNK_SIZE;
+        int res = pwrite_all(evict.fd, data, len, off + i * CHUNK_SIZE);
+        if (res != 0)
+            return res;
+    }
+
+    /* the old slot may have been the base we just copied from */
+    if (!in_place)
+        drop_spill(conv);
+    conv->spill_off = off;
+    conv->spill_cap = cap;
+    conv->base = evict.map + off;
+    conv->base_size = size;
+    for (size_t i = 0; i < conv->nr_chunks; i++) {
+        if (conv->chunks[i] != NULL)
+            free_chunk(conv->chunks[i]);
+        conv->chunks[i] = NULL;
+    }
+    conv->nr_chunks = nr_chunks;
+    untrack_chunks(conv);
+
+    return 0;
+}
+
+/* sweep the ring until we are back under the budget, with some slack */
+static void evict_some(void) {
+    size_t low = evict.budget - evict.budget / 8;
+
+    pthread_mutex_lock(&evict.lock);
+    while (!evict.stop && evict.hand != NULL &&
+           __atomic_load_n(&evict.resident, __ATOMIC_RELAXED) > low) {
+        struct conversation *conv = evict.hand;
+        evict.hand = conv->clock_next;
+        if (__atomic_exchange_n(&conv->referenced, 0, __ATOMIC_RELAXED) || !tryget_conv(conv))
+            continue;
+        pthread_mutex_unlock(&evict.lock);
+
+        pthread_rwlock_wrlock(&conv->lock);
+        int res = evict_conv(conv);
+        pthread_rwlock_unlock(&conv->lock);
+        put_conv(conv);
+        if (res != 0) {
+            fprintf(stderr, "spill: %s\n", strerror(-res));
+            return;
+        }
+
+        pthread_mutex_lock(&evict.lock);
+    }
+    pthread_mutex_unlock(&evict.lock);
+}
+
+static void *evict_worker(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&evict.lock);
+    while (!evict.stop) {
+        if (!evict_over()) {
+            pthread_cond_wait(&evict.wake, &evict.lock);
+            continue;
+        }
+        pthread_mutex_unlock(&evict.lock);
+        evict_some();
+        pthread_mutex_lock(&evict.lock);
+    }
+    pthread_mutex_unlock(&evict.lock);
+
+    return NULL;
+}
+
+/* an unlinked spill file in dir, mapped for reading evicted bodies */
+static int init_spill(const char *dir, size_t budget) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/daidai-spill.XXXXXX", dir) >= (int) sizeof(path))
+        return -ENAMETOOLONG;
+
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return -errno;
+    unlink(path);
+    void *map = mmap(NULL, SPILL_MAP_SIZE, PROT_READ, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (map == MAP_FAILED) {
+        int res = -errno;
+        close(fd);
+        return res;
+    }
+
+    evict.fd = fd;
+    evict.map = map;
+    evict.budget = budget;
+    return 0;
+}
+
+/*
+ * Kernel cache invalidation (-o cache)
+ *
+ * With the cache on, the kernel keeps pages and attributes of both ends of
+ * a conversation, so a write has to drop them. Notifying from inside the
+ * write request could deadlock with the kernel, so writes only queue the
+ * conversation and a worker thread sends the notifications. A conversation
+ * is queued at most once until the worker gets to it.
+ *
+ * The kernel also keeps entries, and names it found missing, so entries
+ * made or removed without it knowing, like the other end of a
+ * conversation, are queued by name for the worker too.
+ */
+#define CACHE_TIMEOUT_DEFAULT 60
+
+static struct fuse_session *session;
+
+struct inval_entry {
+    fuse_ino_t parent;
+    struct inval_entry *next;
+    size_t len;
+    char name[];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct conversation *head, **tail;
+    struct inval_entry *entries;
+    int stop;
+    int running;
+    pthread_t thread;
+} inval = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .wake = PTHREAD_COND_INITIALIZER,
+        .tail = &inval.head,
+};
+
+/* no allocation: the queue is linked through the conversations */
+static void queue_inval(struct conversation *conv) {
+    if (!inval.running || __atomic_exchange_n(&conv->inval_pending, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    get_conv(conv);
+    pthread_mutex_lock(&inval.lock);
+    conv->inval_next = NULL;
+    *inval.tail = conv;
+    inval.tail = &conv->inval_next;
+    pthread_cond_signal(&inval.wake);
+    pthread_mutex_unlock(&inval.lock);
+}
+
+/* name in dir changed behind the kernel's back; dir is NULL for the limbo, which it never saw */
+static void queue_inval_entry(struct daidai_node *dir, const char *name) {
+    if (!inval.running || dir == NULL)
+        return;
+
+    /* without memory the entry timeout still bounds how long it is stale */
+    size_t len = strlen(name);
+    struct inval_entry *entry = xmalloc(sizeof(struct inval_entry) + len + 1);
+    if (entry == NULL)
+        return;
+    entry->parent = ino_of(dir);
+    entry->len = len;
+    memcpy(entry->name, name, len + 1);
+
+    pthread_mutex_lock(&inval.lock);
+    entry->next = inval.entries;
+    inval.entries = entry;
+    pthread_cond_signal(&inval.wake);
+    pthread_mutex_unlock(&inval.lock);
+}
+
+static struct conversation *dequeue_inval(void) {
+    struct conversation *conv = inval.head;
+
+    if (conv != NULL) {
+        inval.head = conv->inval_next;
+        if (inval.head == NULL)
+            inval.tail = &inval.head;
+    }
+    return conv;
+}
+
+/*
+ * The inode numbers are copied out under the conversation's lock and
+ * notified after dropping it: the kernel may need another callback to
+ * finish a notification.
+ */
+static void *inval_worker(void *arg) {
+    fuse_ino_t *inos = NULL;
+    size_t max_inos = 0;
+    (void) arg;
+
+    pthread_mutex_lock(&inval.lock);
+    while (!inval.stop) {
+        struct inval_entry *entry = inval.entries;
+        if (entry != NULL) {
+            inval.entries = NULL;
+            pthread_mutex_unlock(&inval.lock);
+            while (entry != NULL) {
+                struct inval_entry *next = entry->next;
+                fuse_lowlevel_notify_inval_entry(session, entry->parent, entry->name, entry->len);
+                xfree(entry);
+                entry = next;
+            }
+            pthread_mutex_lock(&inval.lock);
+            continue;
+        }
+
+        struct conversation *conv = dequeue_inval();
+        if (conv == NULL) {
+            pthread_cond_wait(&inval.wake, &inval.lock);
+            continue;
+        }
+        pthread_mutex_unlock(&inval.lock);
+
+        /* clear first, a write racing with us queues the conversation again */
+        __atomic_store_n(&conv->inval_pending, 0, __ATOMIC_RELEASE);
+
+        size_t nr_inos = 0;
+        pthread_rwlock_rdlock(&conv->lock);
+        for (struct daidai_node *end = conv->ends; end != NULL; end = end->conv_next) {
+            if (nr_inos == max_inos) {
+                size_t grown_max = max_inos ? max_inos * 2 : 4;
+                fuse_ino_t *grown = xrealloc(inos, grown_max * sizeof(fuse_ino_t));
+                if (grown == NULL)
+                    break;
+                inos = grown;
+                max_inos = grown_max;
+            }
+            inos[nr_inos++] = ino_of(end);
+        }
+        pthread_rwlock_unlock(&conv->lock);
+
+        for (size_t i = 0; i < nr_inos; i++)
+            fuse_lowlevel_notify_inval_inode(session, inos[i], 0, 0);
+        put_conv(conv);
+
+        pthread_mutex_lock(&inval.lock);
+    }
+    pthread_mutex_unlock(&inval.lock);
+    xfree(inos);
+
+    return NULL;
+}
+
+/*
+ * Removing a directory
+ *
+ * rmdir detaches the directory with its whole subtree in one step, and
+ * for a bot drops the other ends of its conversations as well. A worker
+ * thread then walks the subtree, unlinking and freeing it, so the request
+ * does not wait for that. The queue is linked through conv_next, which
+ * directories have no other use for.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct daidai_node *head;
+    int stop;
+    int running;
+    pthread_t thread;
+} reclaim = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .wake = PTHREAD_COND_INITIALIZER,
+};
+
+/* unlink everything below dir and drop dir's own reference */
+static void reclaim_tree(struct daidai_node *dir) {
+    pthread_rwlock_wrlock(dir->lock);
+    dir->unlinked = 1;
+    while (!RB_EMPTY_ROOT(&dir->children)) {
+        struct daidai_node *entry = child_of(dir->children.rb_node);
+        erase_child(entry);
+        entry->unlinked = 1;
+        if (entry->type == Directory)
+            reclaim_tree(entry);
+        else
+            put_node(entry, 1);
+    }
+    pthread_rwlock_unlock(dir->lock);
+    put_node(dir, 1);
+}
+
+static void *reclaim_worker(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&reclaim.lock);
+    while (!reclaim.stop || reclaim.head != NULL) {
+        struct daidai_node *dir = reclaim.head;
+        if (dir == NULL) {
+            pthread_cond_wait(&reclaim.wake, &reclaim.lock);
+            continue;
+        }
+        reclaim.head = dir->conv_next;
+        pthread_mutex_unlock(&reclaim.lock);
+
+        reclaim_tree(dir);
+
+        pthread_mutex_lock(&reclaim.lock);
+    }
+    pthread_mutex_unlock(&reclaim.lock);
+
+    return NULL;
+}
+
+/* before the session starts there is no worker, the tree goes at once */
+static void queue_reclaim(struct daidai_node *dir) {
+    if (!reclaim.running) {
+        reclaim_tree(dir);
+        return;
+    }
+
+    pthread_mutex_lock(&reclaim.lock);
+    dir->conv_next = reclaim.head;
+    reclaim.head = dir;
+    pthread_cond_signal(&reclaim.wake);
+    pthread_mutex_unlock(&reclaim.lock);
+}
+
+/* unlink node's peer, /b/a for /a/b, if it still shares the conversation; on another node, there */
+static void drop_peer(struct daidai_node *node) {
+    char rev_path[PATH_MAX];
+
+    if (node->type != File || reverse_path(node->path, rev_path, sizeof(rev_path)) != 0 ||
+        strcmp(rev_path, node->path) == 0)
+        return;
+    if (node->conv->shard >= 0) {
+        cluster_queue(node->conv->shard, JOURNAL_UNLINK, rev_path, NULL);
+        return;
+    }
+
+    struct daidai_node *peer = peer_dir(node->path);
+    if (peer != NULL)
+        pthread_rwlock_wrlock(peer->lock);
+    struct daidai_node *rev = lookup_in(peer, rev_path);
+    if (rev != NULL && rev->conv == node->conv) {
+        /* the kernel only saw node go */
+        queue_inval_entry(peer, rev->name);
+        erase_node(rev);
+    }
+    if (peer != NULL)
+        pthread_rwlock_unlock(peer->lock);
+}
+
+/*
+ * Detach dir and everything below it, callers hold the lock of the
+ * directory above for writing. Removing a bot then drops its peers one
+ * entry at a time, resuming by name like readdir, so dir's lock is never
+ * held while taking another bot's.
+ */
+static void erase_tree(struct daidai_node *dir) {
+    detach_node(dir);
+
+    pthread_rwlock_wrlock(dir->lock);
+    dir->unlinked = 1;
+    pthread_rwlock_unlock(dir->lock);
+
+    char name[NAME_MAX + 1] = "";
+    while (dir != root_node && strchr(dir->path + 1, '/') == NULL) {
+        pthread_rwlock_rdlock(dir->lock);
+        struct daidai_node *entry = next_child(dir, name);
+        if (entry != NULL) {
+            __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+            strncpy(name, entry->name, NAME_MAX);
+        }
+        pthread_rwlock_unlock(dir->lock);
+        if (entry == NULL)
+            break;
+
+        drop_peer(entry);
+        put_node(entry, 1);
+    }
+
+    queue_reclaim(dir);
+}
+
+static double cache_timeout(void) {
+    return options.cache ? options.cache_timeout : 0;
+}
+
+/* views are read-only and, like virtual files, have no size; a.tail is a directory */
+static void fill_stat(struct stat *stbuf, struct daidai_node *node, fuse_ino_t view) {
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = ino_of(node) | view;
+    if (node->type == Directory || view == TAIL) {
+        stbuf->st_mode = S_IFDIR | (view ? 0555 : 0755);
+        stbuf->st_nlink = 2;
+    } else if (view) {
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+    } else if (node->type == File) {
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        pthread_rwlock_rdlock(&node->conv->lock);
+        stbuf->st_size = node->conv->size - node->conv->start;
+        pthread_rwlock_unlock(&node->conv->lock);
+    } else {
+        stbuf->st_mode = S_IFREG | (node->vops->write ? 0644 : 0444);
+        stbuf->st_nlink = 1;
+    }
+}
+
+/* the kernel holds a reference to node from now on, callers hold its directory's lock */
+static void fill_entry(struct fuse_entry_param *e, struct daidai_node *node, fuse_ino_t view) {
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    __atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+    e->ino = ino_of(node) | view;
+    e->attr_timeout = cache_timeout();
+    e->entry_timeout = cache_timeout();
+    fill_stat(&e->attr, node, view);
+}
+
+/* drop n kernel references */
+static void forget_node(struct daidai_node *node, uint64_t n) {
+    traceLog(TRACE_FORGET, node->path);
+    put_node(node, n);
+}
+
+/*
+ * fill in fi->fh for node. What it reads of the node never changes after
+ * create_node, so no lock is needed while the kernel holds a reference.
+ */
+static int open_node(struct daidai_node *node, fuse_ino_t view, struct fuse_file_info *fi) {
+    if (node->type == Directory || view == TAIL)
+        return -EISDIR;
+    if (view && (fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EACCES;
+
+    struct file_handle *fh = xmalloc(sizeof(struct file_handle));
+    if (fh == NULL)
+        return -ENOMEM;
+    fh->type = node->type;
+    fh->view = view & (INBOX | TAIL);
+
+    if (node->type == File) {
+        fh->conv = get_conv(node->conv);
+        fh->seen = 0;
+        fh->poll = NULL;
+        /* a read at the end has to reach us to wait there */
+        fi->keep_cache = options.cache && !options.blocking_read && !view;
+        fi->direct_io = options.blocking_read || view;
+        if (fh->view == INBOX) {
+            pthread_rwlock_rdlock(&fh->conv->lock);
+            fh->seen = fh->conv->size;
+            pthread_rwlock_unlock(&fh->conv->lock);
+            fi->nonseekable = 1;
+        } else if (fh->view == TAIL) {
+            /* the messages are picked once, the handle reads like a file of them */
+            pthread_rwlock_rdlock(&fh->conv->lock);
+            last_messages(fh->conv, tail_count(view), &fh->from, &fh->to);
+            pthread_rwlock_unlock(&fh->conv->lock);
+        }
+    } else {
+        fh->vbuf = node->vops->render();
+        if (fh->vbuf == NULL) {
+            xfree(fh);
+            return -ENOMEM;
+        }
+        fh->vbuf->ops = node->vops;
+        fh->vbuf->priv = NULL;
+        fh->vbuf->read = 0;
+        pthread_mutex_init(&fh->lock, NULL);
+        fi->direct_io = 1;
+    }
+    fi->fh = (uint64_t) (uintptr_t) fh;
+
+    return 0;
+}
+
+/* "<dir path>/<name>" into buf */
+static int child_path(struct daidai_node *dir, const char *name, char *buf, size_t size) {
+    const char *sep = dir == root_node ? "" : "/";
+    int len = snprintf(buf, size, "%s%s%s", dir->path, sep, name);
+
+    return len < 0 || (size_t) len >= size ? -ENAMETOOLONG : 0;
+}
+
+static void daidai_init(void *userdata, struct fuse_conn_info *conn) {
+    traceLog(TRACE_INIT, "");
+
+    (void) userdata;
+    /*
+     * writes then reach write_buf still in the pipe they were spliced to;
+     * libfuse asks for it whenever there is a write_buf, so it is turned
+     * off again without the option
+     */
+    if (options.splice && (conn->capable & FUSE_CAP_SPLICE_READ))
+        conn->want |= FUSE_CAP_SPLICE_READ;
+    else
+        conn->want &= ~FUSE_CAP_SPLICE_READ;
+    if (journal_on() && compact.threshold)
+        compact.running = pthread_create(&compact.thread, NULL, compact_worker, NULL) == 0;
+    if (evict.budget)
+        evict.running = pthread_create(&evict.thread, NULL, evict_worker, NULL) == 0;
+    if (options.cache)
+        inval.running = pthread_create(&inval.thread, NULL, inval_worker, NULL) == 0;
+    reclaim.running = pthread_create(&reclaim.thread, NULL, reclaim_worker, NULL) == 0;
+}
+
+static void daidai_destroy(void *userdata) {
+    (void) userdata;
+
+    if (compact.running) {
+        pthread_mutex_lock(&journal.lock);
+        compact.stop = 1;
+        pthread_cond_signal(&compact.wake);
+        pthread_mutex_unlock(&journal.lock);
+        pthread_join(compact.thread, NULL);
+        compact.running = 0;
+    }
+    if (evict.running) {
+        pthread_mutex_lock(&evict.lock);
+        evict.stop = 1;
+        pthread_cond_signal(&evict.wake);
+        pthread_mutex_unlock(&evict.lock);
+        pthread_join(evict.thread, NULL);
+        evict.running = 0;
+    }
+    if (reclaim.running) {
+        pthread_mutex_lock(&reclaim.lock);
+        reclaim.stop = 1;
+        pthread_cond_signal(&reclaim.wake);
+        pthread_mutex_unlock(&reclaim.lock);
+        pthread_join(reclaim.thread, NULL);
+        reclaim.running = 0;
+    }
+    if (!inval.running)
+        return;
+
+    pthread_mutex_lock(&inval.lock);
+    inval.stop = 1;
+    pthread_cond_signal(&inval.wake);
+    pthread_mutex_unlock(&inval.lock);
+    pthread_join(inval.thread, NULL);
+    inval.running = 0;
+
+    struct conversation *conv;
+    while ((conv = dequeue_inval()) != NULL) {
+        __atomic_store_n(&conv->inval_pending, 0, __ATOMIC_RELEASE);
+        put_conv(conv);
+    }
+    while (inval.entries != NULL) {
+        struct inval_entry *entry = inval.entries;
+        inval.entries = entry->next;
+        xfree(entry);
+    }
+}
+
+/* N in a.tail/N, 0 when name is not one */
+static size_t parse_tail(const char *name) {
+    size_t n = 0;
+
+    if (name[0] < '1' || name[0] > '9')
+        return 0;
+    for (; *name >= '0' && *name <= '9' && n <= TAIL_MAX; name++)
+        n = n * 10 + (*name - '0');
+    return *name == '\0' && n <= TAIL_MAX ? n : 0;
+}
+
+/* the conversation whose tail view is name, callers hold dir->lock */
+static struct daidai_node *find_tail(struct daidai_node *dir, const char *name) {
+    size_t len = strlen(name), suffix = strlen(TAIL_SUFFIX);
+    char peer[NAME_MAX + 1];
+
+    if (!options.framed || !is_bot(dir) || len <= suffix || len > NAME_MAX ||
+        strcmp(name + len - suffix, TAIL_SUFFIX) != 0)
+        return NULL;
+    memcpy(peer, name, len - suffix);
+    peer[len - suffix] = '\0';
+
+    struct daidai_node *node = find_child(dir, peer);
+    /* N goes above the address in the inode number */
+    if (node == NULL || node->type != File || (uintptr_t) node >> TAIL_SHIFT)
+        return NULL;
+    return node;
+}
+
+static void daidai_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    traceLog(TRACE_LOOKUP, name);
+
+    struct fuse_entry_param e;
+    int res = 0;
+
+    struct daidai_node *dir = node_of(parent);
+    fuse_ino_t view = view_of(parent);
+    if (view == TAIL) {
+        size_t n = parse_tail(name);
+        if (n == 0)
+            res = ENOENT;
+        else
+            fill_entry(&e, dir, tail_view(n));
+    } else if (dir->type != Directory)
+        res = ENOTDIR;
+    else if (!view && is_bot(dir) && strcmp(name, INBOX_NAME) == 0)
+        fill_entry(&e, dir, INBOX);
+    else {
+        pthread_rwlock_rdlock(dir->lock);
+        struct daidai_node *node = find_child(dir, name);
+        if (node == NULL && !view && (node = find_tail(dir, name)) != NULL)
+            fill_entry(&e, node, TAIL);
+        else if (node == NULL || (view && node->type != File))
+            res = ENOENT;
+        else
+            fill_entry(&e, node, view);
+        pthread_rwlock_unlock(dir->lock);
+    }
+
+    if (res != 0)
+        fuse_reply_err(req, res);
+    else
+        fuse_reply_entry(req, &e);
+}
+
+static void daidai_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    forget_node(node_of(ino), nlookup);
+    fuse_reply_none(req);
+}
+
+static void daidai_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+    for (size_t i = 0; i < count; i++)
+        forget_node(node_of(forgets[i].ino), forgets[i].nlookup);
+    fuse_reply_none(req);
+}
+
+static void daidai_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void) fi;
+
+    struct stat stbuf;
+    struct daidai_node *node = node_of(ino);
+    traceLog(TRACE_GETATTR, node->path);
+    fill_stat(&stbuf, node, view_of(ino));
+
+    fuse_reply_attr(req, &stbuf, cache_timeout());
+}
+
+/* only touch(1) style updates are accepted, and they change nothing */
+static void daidai_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+                           struct fuse_file_info *fi) {
+    (void) attr;
+    (void) fi;
+
+    struct stat stbuf;
+    struct daidai_node *node = node_of(ino);
+    traceLog(TRACE_SETATTR, node->path);
+    fill_stat(&stbuf, node, view_of(ino));
+
+    if ((to_set & FUSE_SET_ATTR_SIZE) && node->type == File)
+        fuse_reply_err(req, EPERM);
+    else
+        fuse_reply_attr(req, &stbuf, cache_timeout());
+}
+
+static void daidai_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct daidai_node *node = node_of(ino);
+    traceLog(TRACE_OPEN, node->path);
+    int res = open_node(node, view_of(ino), fi);
+
+    if (res != 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_open(req, fi);
+}
+
+/*
+ * Waiting for messages
+ *
+ * A File handle remembers where its last read ended. poll reports it
+ * readable while the conversation is longer than that and otherwise
+ * queues the poll handle on the conversation. With -o blocking_read a
+ * read at the end waits in the same queue instead of returning 0, so
+ * File handles are opened with direct_io for the kernel to pass it on.
+ * The next write to either end takes the whole queue.
+ *
+ * A waiting read holds no thread: the writer answers it, or the interrupt
+ * callback does with EINTR when the reader gives up. Whoever unqueues a
+ * read owns it; the writer clears the callback before replying, which
+ * also waits for one already running.
+ */
+struct waiter {
+    struct waiter *next;
+    struct file_handle *fh;
+    struct fuse_pollhandle *ph;     /* a poll, or else */
+    fuse_req_t req;                 /* a read of size bytes at offset */
+    size_t size;
+    off_t offset;
+    int queued;                     /* under conv->lock */
+    int interrupted;                /* under conv->lock */
+};
+
+/* callers hold conv->lock for writing */
+static void queue_waiter(struct conversation *conv, struct waiter *w) {
+    w->next = conv->waiters;
+    conv->waiters = w;
+    w->queued = 1;
+}
+
+static void unqueue_waiter(struct conversation *conv, struct waiter *w) {
+    struct waiter **link = &conv->waiters;
+
+    while (*link != w)
+        link = &(*link)->next;
+    *link = w->next;
+    w->queued = 0;
+}
+
+/* where a read at offset starts, -1 for where the last one ended; callers hold conv->lock */
+static size_t read_from(struct file_handle *fh, off_t offset) {
+    return fh->view == INBOX || offset < 0 ? __atomic_load_n(&fh->seen, __ATOMIC_RELAXED) :
+           (size_t) offset + fh->conv->start;
+}
+
+/*
+ * unqueue the waiters that a write got past, a write into a hole leaves
+ * the others. Callers hold conv->lock for writing and pass the list to
+ * wake_waiters after dropping it.
+ */
+static struct waiter *take_waiters(struct conversation *conv) {
+    struct waiter *list = NULL, **link = &conv->waiters;
+
+    while (*link != NULL) {
+        struct waiter *w = *link;
+        if (read_from(w->fh, w->ph ? -1 : w->offset) >= conv->size) {
+            link = &w->next;
+            continue;
+        }
+        *link = w->next;
+        w->queued = 0;
+        if (w->ph != NULL)
+            w->fh->poll = NULL;
+        w->next = list;
+        list = w;
+    }
+    return list;
+}
+
+/*
+ * answer a read of fh's conversation. An inbox read claims its bytes by
+ * moving the cursor, so concurrent reads of one handle never return the
+ * same message twice. A tail read is a read of the messages it picked,
+ * which ends early once retention dropped them. Other reads are of the
+ * kept bytes, offset 0 being conv->start.
+ *
+ * The reply points at the chunks, or the mapped image, and the kernel
+ * copies straight from there: the lock is held until it has, so nothing
+ * is evicted underneath.
+ */
+#define READ_INLINE_IOV 8
+
+static void reply_read(fuse_req_t req, struct file_handle *fh, size_t size, off_t offset) {
+    struct iovec inline_iov[READ_INLINE_IOV], *iov = inline_iov;
+    if (conv_iov_max(size) > READ_INLINE_IOV) {
+        iov = xmalloc(conv_iov_max(size) * sizeof(struct iovec));
+        if (iov == NULL) {
+            fuse_reply_err(req, ENOMEM);
+            return;
+        }
+    }
+
+    struct conversation *conv = fh->conv;
+    int n;
+    touch_conv(conv);
+    pthread_rwlock_rdlock(&conv->lock);
+    if (fh->view == TAIL) {
+        size_t len = (size_t) offset < fh->to - fh->from ? fh->to - fh->from - offset : 0;
+        n = conv_iov(conv, len < size ? len : size, fh->from + offset, iov);
+    } else if (fh->view == INBOX) {
+        /* what was dropped before it was read is skipped */
+        size_t seen = __atomic_load_n(&fh->seen, __ATOMIC_RELAXED), from, len;
+        do {
+            from = seen > conv->start ? seen : conv->start;
+            len = from < conv->size ? conv->size - from : 0;
+            if (len > size)
+                len = size;
+        } while (!__atomic_compare_exchange_n(&fh->seen, &seen, from + len, 1,
+                                              __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        n = conv_iov(conv, len, from, iov);
+    } else {
+        size_t from = offset + conv->start;
+        size_t len = from < conv->size ? conv->size - from : 0;
+        n = conv_iov(conv, size, from, iov);
+        __atomic_store_n(&fh->seen, from + (len < size ? len : size), __ATOMIC_RELAXED);
+    }
+    fuse_reply_iov(req, iov, n);
+    pthread_rwlock_unlock(&conv->lock);
+
+    if (iov != inline_iov)
+        xfree(iov);
+}
+
+static void wake_waiters(struct waiter *list) {
+    while (list != NULL) {
+        struct waiter *w = list;
+        list = w->next;
+
+        if (w->ph != NULL) {
+            fuse_lowlevel_notify_poll(w->ph);
+            fuse_pollhandle_destroy(w->ph);
+        } else {
+            fuse_req_interrupt_func(w->req, NULL, NULL);
+            reply_read(w->req, w->fh, w->size, w->offset);
+        }
+        xfree(w);
+    }
+}
+
+static void interrupt_read(fuse_req_t req, void *data) {
+    struct waiter *w = data;
+    struct conversation *conv = w->fh->conv;
+
+    pthread_rwlock_wrlock(&conv->lock);
+    int queued = w->queued;
+    if (queued)
+        unqueue_waiter(conv, w);
+    else
+        w->interrupted = 1;
+    pthread_rwlock_unlock(&conv->lock);
+
+    if (queued) {
+        fuse_reply_err(req, EINTR);
+        xfree(w);
+    }
+}
+
+/* returns 1 when the read at offset was queued or answered, 0 when it can be served now */
+static int wait_read(fuse_req_t req, struct file_handle *fh, size_t size, off_t offset,
+                     int nonblock) {
+    struct conversation *conv = fh->conv;
+
+    pthread_rwlock_rdlock(&conv->lock);
+    int ready = read_from(fh, offset) < conv->size;
+    pthread_rwlock_unlock(&conv->lock);
+    if (ready || size == 0)
+        return 0;
+    if (nonblock) {
+        fuse_reply_err(req, EAGAIN);
+        return 1;
+    }
+
+    struct waiter *w = xcalloc(1, sizeof(struct waiter));
+    if (w == NULL)
+        return 0;
+    w->fh = fh;
+    w->req = req;
+    w->size = size;
+    w->offset = offset;
+    /* before queueing: once queued, a writer may answer req at any time */
+    fuse_req_interrupt_func(req, interrupt_read, w);
+
+    pthread_rwlock_wrlock(&conv->lock);
+    ready = read_from(fh, offset) < conv->size;
+    if (!ready && !w->interrupted) {
+        queue_waiter(conv, w);
+        pthread_rwlock_unlock(&conv->lock);
+        return 1;
+    }
+    pthread_rwlock_unlock(&conv->lock);
+
+    fuse_req_interrupt_func(req, NULL, NULL);
+    xfree(w);
+    if (ready)
+        return 0;
+    fuse_reply_err(req, EINTR);
+    return 1;
+}
+
+static void daidai_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                        struct fuse_file_info *fi) {
+    (void) ino;
+    traceLog(TRACE_READ, NULL);
+
+    struct file_handle *fh = handle_of(fi);
+    if (fh->type == Virtual) {
+        pthread_mutex_lock(&fh->lock);
+        struct vfile_buf *vbuf = fh->vbuf;
+        if (vbuf->ops->stream)
+            offset = vbuf->read;
+        if (offset < 0) {
+            pthread_mutex_unlock(&fh->lock);
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        if ((size_t) offset >= vbuf->size)
+            size = 0;
+        else if (size > vbuf->size - (size_t) offset)
+            size = vbuf->size - (size_t) offset;
+        vbuf->read = offset + size;
+        fuse_reply_buf(req, vbuf->data + offset, size);
+        pthread_mutex_unlock(&fh->lock);
+        return;
+    }
+
+    if (options.blocking_read && fh->view != TAIL && wait_read(req, fh, size, offset, fi->flags & O_NONBLOCK))
+        return;
+    reply_read(req, fh, size, offset);
+}
+
+/*
+ * Retention (-o retain_size, retain_messages, retain_age, /.retain)
+ *
+ * A conversation past one of its limits loses whole chunks from the
+ * front: they are freed, the pointers to the rest slide down and start
+ * moves past them, so none of what is kept is copied. Each limit keeps at
+ * least what it asks for, up to a chunk more, and is the conversation's
+ * own where it has one, the mount's otherwise. A chunk's age counts from
+ * the last append to it, and limits are checked when a conversation is
+ * appended to. Files show the kept bytes from offset 0.
+ *
+ * A drop is journaled as the new start, so a replay drops the same bytes
+ * whatever the limits are by then.
+ */
+#define RETAIN_LINE_MAX (2 * NAME_MAX + 128)
+
+static struct retention retain_mount;
+
+/* where the kept bytes may start, callers hold conv->lock */
+static size_t retain_from(const struct conversation *conv) {
+    uint64_t size = conv->retain.size ? conv->retain.size : retain_mount.size;
+    uint64_t messages = conv->retain.messages ? conv->retain.messages : retain_mount.messages;
+    uint64_t age = conv->retain.age ? conv->retain.age : retain_mount.age;
+    size_t from = conv->start, nr = nr_marks(conv);
+
+    if (size && conv->size - from > size)
+        from = conv->size - size;
+    if (messages && nr > messages && mark_at(conv, nr - messages - 1) > from)
+        from = mark_at(conv, nr - messages - 1);
+    from -= from % CHUNK_SIZE;
+    if (age) {
+        /* only full chunks, appends may still be filling the last one */
+        time_t now = time(NULL);
+        size_t i = (from - conv->start) / CHUNK_SIZE;
+        while (i < (conv->size - conv->start) / CHUNK_SIZE && conv->stamps[i] + (time_t) age <= now)
+            i++;
+        from = conv->start + i * CHUNK_SIZE;
+    }
+
+    return from;
+}
+
+/* forget the bytes before from, a multiple of CHUNK_SIZE; callers hold conv->lock for writing */
+static void drop_front(struct conversation *conv, size_t from) {
+    size_t n = (from - conv->start) / CHUNK_SIZE, freed = 0;
+
+    for (size_t i = 0; i < n; i++)
+        if (conv->chunks[i] != NULL) {
+            free_chunk(conv->chunks[i]);
+            freed++;
+        }
+    memmove(conv->chunks, conv->chunks + n, (conv->nr_chunks - n) * sizeof(struct chunk *));
+    memmove(conv->stamps, conv->stamps + n, (conv->nr_chunks - n) * sizeof(time_t));
+    conv->nr_chunks -= n;
+    if (conv->base_size > n * CHUNK_SIZE) {
+        conv->base += n * CHUNK_SIZE;
+        conv->base_size -= n * CHUNK_SIZE;
+    } else
+        conv->base_size = 0;
+
+    if (freed > 0 && freed == conv->nr_resident)
+        untrack_chunks(conv);
+    else if (freed > 0 && conv->nr_resident > 0) {
+        conv->nr_resident -= freed;
+        __atomic_sub_fetch(&evict.resident, freed * CHUNK_SIZE, __ATOMIC_RELAXED);
+    }
+
+    while (nr_marks(conv) > 0 && mark_at(conv, 0) <= from) {
+        if (conv->nr_base_marks > 0) {
+            conv->base_marks++;
+            conv->nr_base_marks--;
+        } else {
+            conv->first_mark++;
+            conv->nr_marks--;
+        }
+        conv->dropped_marks++;
+    }
+
+    __atomic_sub_fetch(&usage.content, from - conv->start, __ATOMIC_RELAXED);
+    conv->start = from;
+}
+
+/*
+ * apply conv's limits, callers hold conv->lock for writing. A drop the
+ * journal failed to take is made again after a restart, at the next
+ * append, so its error is not the caller's.
+ */
+static void retain_conv(struct conversation *conv) {
+    size_t from = retain_from(conv);
+    uint64_t lsn;
+
+    if (from == conv->start)
+        return;
+    if (journal_on() && conv->ends != NULL)
+        journal_append(JOURNAL_DROP, conv->ends->path, NULL, 0, from, &lsn);
+    drop_front(conv, from);
+}
+
+static struct vfile_buf *renderRetain(void) {
+    struct vfile_buf *out = xmalloc(sizeof(struct vfile_buf) + 3 * 32);
+    if (out == NULL)
+        return NULL;
+
+    out->size = sprintf(out->data, "size\t%llu\nmessages\t%llu\nage\t%llu\n",
+                        (unsigned long long) retain_mount.size,
+                        (unsigned long long) retain_mount.messages,
+                        (unsigned long long) retain_mount.age);
+    return out;
+}
+
+/* "<bot> <peer> [size=N] [messages=N] [age=N]": the limits of bot/peer, one left out is the mount's */
+static int parse_retain(char *line, char **bot, char **peer, struct retention *retain) {
+    char *save, *word;
+
+    memset(retain, 0, sizeof(*retain));
+    *bot = strtok_r(line, " \t\n", &save);
+    *peer = *bot ? strtok_r(NULL, " \t\n", &save) : NULL;
+    if (*peer == NULL)
+        return -EINVAL;
+    while ((word = strtok_r(NULL, " \t\n", &save)) != NULL) {
+        char *value = strchr(word, '='), *end;
+        if (value == NULL || value[1] < '0' || value[1] > '9')
+            return -EINVAL;
+        *value++ = '\0';
+        uint64_t n = strtoull(value, &end, 10);
+        if (*end != '\0')
+            return -EINVAL;
+        if (strcmp(word, "size") == 0)
+            retain->size = n;
+        else if (strcmp(word, "messages") == 0 && options.framed)
+            retain->messages = n;
+        else if (strcmp(word, "age") == 0)
+            retain->age = n;
+        else
+            return -EINVAL;
+    }
+    return 0;
+}
+
+static int writeRetain(struct vfile_buf **vbuf, const char *buf, size_t size) {
+    (void) vbuf;
+
+    char line[RETAIN_LINE_MAX], *bot, *peer;
+    struct retention retain;
+    if (size >= sizeof(line))
+        return -EINVAL;
+    memcpy(line, buf, size);
+    line[size] = '\0';
+    int res = parse_retain(line, &bot, &peer, &retain);
+    if (res != 0)
+        return res;
+
+    struct conversation *conv = NULL;
+    pthread_rwlock_rdlock(root_node->lock);
+    struct daidai_node *dir = find_child(root_node, bot);
+    if (dir != NULL && dir->type == Directory) {
+        pthread_rwlock_rdlock(dir->lock);
+        struct daidai_node *node = find_child(dir, peer);
+        if (node != NULL && node->type == File)
+            conv = get_conv(node->conv);
+        pthread_rwlock_unlock(dir->lock);
+    }
+    pthread_rwlock_unlock(root_node->lock);
+    if (conv == NULL)
+        return -ENOENT;
+
+    uint64_t lsn = 0;
+    pthread_rwlock_wrlock(&conv->lock);
+    if (journal_on() && conv->ends != NULL)
+        res = journal_append(JOURNAL_RETAIN, conv->ends->path, (const char *) &retain,
+                             sizeof(retain), 0, &lsn);
+    if (res == 0) {
+        conv->retain = retain;
+        retain_conv(conv);
+    }
+    pthread_rwlock_unlock(&conv->lock);
+    queue_inval(conv);
+    put_conv(conv);
+
+    res = res ? res : journal_sync(lsn);
+    return res ? res : (int) size;
+}
+
+static const struct vfile_ops retain_file_ops = {
+        .render = renderRetain,
+        .write  = writeRetain,
+};
+
+/*
+ * append src to conv, see claim_append. src is copied straight into the
+ * chunks, from the request pipe when it was spliced (-o splice), and the
+ * journal record is made from the chunks, like the delivery to the other
+ * node when there is one.
+ */
+static int write_file(struct conversation *conv, struct fuse_bufvec *src) {
+    union {
+        struct fuse_bufvec bufv;
+        char space[sizeof(struct fuse_bufvec) + APPEND_INLINE * sizeof(struct fuse_buf)];
+    } local;
+    struct fuse_bufvec *dst = &local.bufv;
+    struct append app;
+    uint64_t lsn = 0;
+
+    size_t size = fuse_buf_size(src);
+    if (size == 0)
+        return 0;
+    cluster_wait_room(conv->shard);
+    touch_conv(conv);
+    pthread_rwlock_wrlock(&conv->lock);
+    int res = claim_append(conv, size, &app);
+    pthread_rwlock_unlock(&conv->lock);
+    if (res != 0)
+        return res;
+
+    if (app.nr_chunks > APPEND_INLINE + 1)
+        dst = xmalloc(sizeof(struct fuse_bufvec) + app.nr_chunks * sizeof(struct fuse_buf));
+    if (dst != NULL) {
+        append_bufv(&app, dst);
+        ssize_t copied = fuse_buf_copy(dst, src, 0);
+        if (copied != (ssize_t) size)
+            res = copied < 0 ? (int) copied : -EIO;
+    } else
+        res = -ENOMEM;
+    /* the space is claimed whatever happens, what could not be copied reads as zeros */
+    if (res != 0)
+        fill_append(&app, 0, NULL, size);
+
+    /* the record names the conversation by one of its ends */
+    publish_wait(conv, &app);
+    if (res == 0 && journal_on() && conv->ends != NULL)
+        res = journal_append_bufv(JOURNAL_WRITE, conv->ends->path, dst, app.offset, &lsn);
+    if (res == 0 && conv->shard >= 0 && conv->ends != NULL)
+        res = forward_write(conv, dst);
+    if (dst != &local.bufv)
+        xfree(dst);
+    publish_append(conv, &app);
+    if (options.framed) {
+        int marked = add_mark(conv, app.offset + size);
+        res = res ? res : marked;
+    }
+    retain_conv(conv);
+    struct waiter *waiters = take_waiters(conv);
+    pthread_rwlock_unlock(&conv->lock);
+    wake_waiters(waiters);
+    queue_inval(conv);
+
+    return res ? res : journal_sync(lsn);
+}
+
+/* virtual files parse what they are written, so they get it in one piece */
+static int write_virtual(struct file_handle *fh, struct fuse_bufvec *src) {
+    size_t size = fuse_buf_size(src);
+    char *buf = src->buf[0].mem;
+
+    if (fh->vbuf->ops->write == NULL)
+        return -EACCES;
+    if (src->count != 1 || (src->buf[0].flags & FUSE_BUF_IS_FD)) {
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+        if ((buf = dst.buf[0].mem = xmalloc(size ? size : 1)) == NULL)
+            return -ENOMEM;
+        ssize_t copied = fuse_buf_copy(&dst, src, 0);
+        if (copied != (ssize_t) size) {
+            xfree(buf);
+            return copied < 0 ? (int) copied : -EIO;
+        }
+    }
+
+    pthread_mutex_lock(&fh->lock);
+    int res = fh->vbuf->ops->write(&fh->vbuf, buf, size);
+    pthread_mutex_unlock(&fh->lock);
+    if (buf != src->buf[0].mem)
+        xfree(buf);
+
+    return res;
+}
+
+/*
+ * The offset is ignored: conversations are appended to, and the reverse
+ * path shares the conversation, so one copy is enough.
+ */
+static void daidai_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+                             off_t offset, struct fuse_file_info *fi) {
+    (void) ino;
+    (void) offset;
+    traceLog(TRACE_WRITE, NULL);
+
+    struct file_handle *fh = handle_of(fi);
+    size_t size = fuse_buf_size(bufv);
+    int res;
+    if (fh->type == Virtual)
+        res = write_virtual(fh, bufv);
+    else if ((res = write_file(fh->conv, bufv)) == 0)
+        res = size;
+
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_write(req, res);
+}
+
+static void close_handle(struct file_handle *fh) {
+    if (fh->type == File) {
+        struct conversation *conv = fh->conv;
+        pthread_rwlock_wrlock(&conv->lock);
+        struct waiter *w = fh->poll;
+        if (w != NULL)
+            unqueue_waiter(conv, w);
+        pthread_rwlock_unlock(&conv->lock);
+        if (w != NULL) {
+            fuse_pollhandle_destroy(w->ph);
+            xfree(w);
+        }
+        put_conv(conv);
+    } else {
+        pthread_mutex_destroy(&fh->lock);
+        xfree(fh->vbuf->priv);
+        xfree(fh->vbuf);
+    }
+    xfree(fh);
+}
+
+/* File handles are readable past the end of their last read, and always writable */
+static void daidai_poll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi,
+                        struct fuse_pollhandle *ph) {
+    (void) ino;
+    traceLog(TRACE_POLL, NULL);
+
+    struct file_handle *fh = handle_of(fi);
+    unsigned int revents = POLLOUT | POLLWRNORM;
+    if (fh->type != File || fh->view == TAIL) {
+        if (ph != NULL)
+            fuse_pollhandle_destroy(ph);
+        fuse_reply_poll(req, revents | POLLIN | POLLRDNORM);
+        return;
+    }
+
+    struct conversation *conv = fh->conv;
+    struct fuse_pollhandle *old = ph;
+    int res = 0;
+    pthread_rwlock_wrlock(&conv->lock);
+    if (conv->size > __atomic_load_n(&fh->seen, __ATOMIC_RELAXED))
+        revents |= POLLIN | POLLRDNORM;
+    else if (ph != NULL && fh->poll != NULL) {
+        /* the kernel sends a new handle with every poll, keep the latest */
+        old = fh->poll->ph;
+        fh->poll->ph = ph;
+    } else if (ph != NULL) {
+        struct waiter *w = xcalloc(1, sizeof(struct waiter));
+        if (w != NULL) {
+            w->fh = fh;
+            w->ph = ph;
+            fh->poll = w;
+            queue_waiter(conv, w);
+            old = NULL;
+        } else
+            res = -ENOMEM;
+    }
+    pthread_rwlock_unlock(&conv->lock);
+
+    if (old != NULL)
+        fuse_pollhandle_destroy(old);
+    if (res != 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_poll(req, revents);
+}
+
+static void daidai_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void) ino;
+    traceLog(TRACE_RELEASE, NULL);
+
+    close_handle(handle_of(fi));
+    fuse_reply_err(req, 0);
+}
+
+/* callers hold dir->lock for writing, dir is NULL for the limbo */
+static int make_dir(struct daidai_node *dir, const char *path, struct daidai_node **out) {
+    if (lookup_in(dir, path) != NULL)
+        return -EEXIST;
+
+    *out = create_node(Directory, path, NULL);
+    insert_node(dir, *out);
+    return 0;
+}
+
+static void daidai_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    traceLog(TRACE_MKDIR, name);
+
+    (void) mode;
+
+    struct fuse_entry_param e;
+    struct daidai_node *node;
+    char path[PATH_MAX];
+    uint64_t lsn = 0;
+
+    struct daidai_node *dir = node_of(parent);
+    if (view_of(parent) || dir->type != Directory) {
+        fuse_reply_err(req, view_of(parent) ? EACCES : ENOTDIR);
+        return;
+    }
+    int res = reserved_name(dir, name);
+    if (res == 0)
+        res = child_path(dir, name, path, sizeof(path));
+    /* a bot is made on its own node */
+    if (res == 0 && dir == root_node && remote_node(path) >= 0)
+        res = -EXDEV;
+
+    pthread_rwlock_wrlock(dir->lock);
+    if (res == 0 && dir->unlinked)
+        res = -ENOENT;
+    if (res == 0)
+        res = make_dir(dir, path, &node);
+    if (res == 0)
+        res = journal_append(JOURNAL_MKDIR, path, NULL, 0, 0, &lsn);
+    if (res == 0)
+        fill_entry(&e, node, 0);
+    pthread_rwlock_unlock(dir->lock);
+
+    if (res == 0 && (res = journal_sync(lsn)) != 0)
+        forget_node(node, 1);
+    if (res != 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_entry(req, &e);
+}
+
+/* unlink the entry name from parent, it must (not) be a directory */
+static int remove_entry(fuse_ino_t parent, const char *name, int want_dir) {
+    uint64_t lsn = 0;
+    int res = 0;
+
+    struct daidai_node *dir = node_of(parent);
+    if (view_of(parent))
+        return -EACCES;
+    if (dir->type != Directory)
+        return -ENOTDIR;
+
+    pthread_rwlock_wrlock(dir->lock);
+    struct daidai_node *node = find_child(dir, name);
+    if (node == NULL)
+        res = -ENOENT;
+    else if (want_dir && node->type != Directory)
+        res = -ENOTDIR;
+    else if (!want_dir && node->type == Directory)
+        res = -EISDIR;
+    else
+        res = journal_append(want_dir ? JOURNAL_RMDIR : JOURNAL_UNLINK, node->path,
+                             NULL, 0, 0, &lsn);
+    int leave = res == 0 && !want_dir && is_group_path(node->path);
+    if (leave)
+        __atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+    if (res == 0 && want_dir)
+        erase_tree(node);
+    else if (res == 0)
+        erase_node(node);
+    pthread_rwlock_unlock(dir->lock);
+
+    /* after dir's lock, the other end is in another bot's directory */
+    if (leave) {
+        pthread_rwlock_rdlock(root_node->lock);
+        drop_peer(node);
+        pthread_rwlock_unlock(root_node->lock);
+        put_node(node, 1);
+    }
+
+    return res ? res : journal_sync(lsn);
+}
+
+static void daidai_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    traceLog(TRACE_RMDIR, name);
+
+    fuse_reply_err(req, -remove_entry(parent, name, 1));
+}
+
+static void daidai_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct daidai_node *node = node_of(ino);
+    traceLog(TRACE_OPENDIR, node->path);
+    if (node->type != Directory && view_of(ino) != TAIL) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    struct file_handle *fh = xcalloc(1, sizeof(struct file_handle));
+    if (fh == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    fh->type = Directory;
+    fi->fh = (uint64_t) (uintptr_t) fh;
+
+    fuse_reply_open(req, fi);
+}
+
+/* add one entry to a readdir reply, returns 0 once buf is full */
+static int add_dirent(fuse_req_t req, char *buf, size_t size, size_t *pos,
+                      const char *name, fuse_ino_t ino, mode_t mode, off_t next) {
+    struct stat stbuf;
+
+    memset(&stbuf, 0, sizeof(stbuf));
+    stbuf.st_ino = ino;
+    stbuf.st_mode = mode;
+    size_t len = fuse_add_direntry(req, buf + *pos, size - *pos, name, &stbuf, next);
+    if (len > size - *pos)
+        return 0;
+    *pos += len;
+
+    return 1;
+}
+
+/*
+ * Offsets: 1 and 2 are "." and "..", the n-th child is 2 + n.
+ */
+static void daidai_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                           struct fuse_file_info *fi) {
+    char *buf = xmalloc(size);
+    size_t pos = 0;
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    struct daidai_node *dir = node_of(ino);
+    fuse_ino_t view = view_of(ino);
+    traceLog(TRACE_READDIR, dir->path);
+
+    /* a.tail is a File node with no children: N is made up at lookup, so it looks empty */
+    if (view != TAIL)
+        pthread_rwlock_rdlock(dir->lock);
+
+    struct dir_cursor *cursor = &handle_of(fi)->cursor;
+    struct daidai_node *entry;
+    if (offset < 1 && !add_dirent(req, buf, size, &pos, ".", ino, S_IFDIR, 1))
+        goto out;
+    if (offset < 2 && !add_dirent(req, buf, size, &pos, "..", ino, S_IFDIR, 2))
+        goto out;
+
+    if (view == TAIL)
+        entry = NULL;
+    else if (offset <= 2)
+        entry = child_of(rb_first(&dir->children));
+    else if (cursor->offset == offset)
+        entry = next_child(dir, cursor->name);
+    else {
+        entry = child_of(rb_first(&dir->children));
+        for (off_t skip = offset - 2; entry != NULL && skip > 0; skip--)
+            entry = child_of(rb_next(&entry->child_node));
+    }
+    if (offset < 2)
+        offset = 2;
+
+    for (; entry != NULL; entry = child_of(rb_next(&entry->child_node))) {
+        mode_t mode = entry->type == Directory ? S_IFDIR : S_IFREG;
+        /* views list conversations only, with the same offsets */
+        if (!view || entry->type == File)
+            if (!add_dirent(req, buf, size, &pos, entry->name, ino_of(entry) | view, mode,
+                            offset + 1))
+                break;
+        offset++;
+        cursor->offset = offset;
+        strncpy(cursor->name, entry->name, NAME_MAX);
+
+        traceMsg(TRACE_READDIR, dir->path, entry->name);
+    }
+out:
+    if (view != TAIL)
+        pthread_rwlock_unlock(dir->lock);
+
+    fuse_reply_buf(req, buf, pos);
+    xfree(buf);
+}
+
+static void daidai_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void) ino;
+    traceLog(TRACE_RELEASEDIR, NULL);
+
+    xfree(handle_of(fi));
+    fuse_reply_err(req, 0);
+}
+
+/* callers hold dir->lock for writing, dir is NULL for the limbo */
+static int make_file(struct daidai_node *dir, const char *path, struct daidai_node **out) {
+    if (lookup_in(dir, path) != NULL)
+        return -EEXIST;
+
+    *out = create_node(File, path, NULL);
+    insert_node(dir, *out);
+    return 0;
+}
+
+/* callers hold dir->lock and peer->lock for writing */
+static int make_conversation(struct daidai_node *dir, struct daidai_node *peer, const char *path,
+                             const char *rev_path, struct daidai_node **out) {
+    if (lookup_in(dir, path) != NULL)
+        return -EEXIST;
+
+    /* a group talks to its members only, and is made before they join */
+    int from_group = path[1] == GROUP_MARK, to_group = rev_path[1] == GROUP_MARK;
+    struct daidai_node *room = from_group ? dir : to_group ? peer : NULL;
+    int shard = peer_node(path);
+    if (from_group && to_group)
+        return -EINVAL;
+    /* and lives on one node with them */
+    if ((from_group || to_group) && shard >= 0)
+        return -EXDEV;
+    if ((from_group || to_group) && room == NULL)
+        return -ENOENT;
+
+    /* join the peer's conversation if the other side still exists */
+    struct daidai_node *rev_node = lookup_in(peer, rev_path);
+    if (rev_node != NULL && rev_node->type != File)
+        return -EEXIST;
+
+    struct conversation *conv = rev_node ? rev_node->conv : room ? group_conv(room) : NULL;
+    struct daidai_node *node = create_node(File, path, conv);
+    /* the other end of a conversation with another node's bot is made there */
+    if (shard >= 0)
+        node->conv->shard = shard;
+    else if (rev_node == NULL && strcmp(path, rev_path) != 0) {
+        rev_node = create_node(File, rev_path, node->conv);
+        insert_node(peer, rev_node);
+        queue_inval_entry(peer, rev_node->name);
+    }
+    insert_node(dir, node);
+
+    *out = node;
+    return 0;
+}
+
+/* a plain file, or one end of a conversation for "/a/b" */
+static int make_path(struct daidai_node *dir, struct daidai_node *peer, const char *path,
+                     struct daidai_node **out) {
+    //reverse
+    char rev_path[PATH_MAX];
+    if (!is_conversation(path) || reverse_path(path, rev_path, sizeof(rev_path)) != 0)
+        return make_file(dir, path, out);
+    traceMsg(TRACE_CREATE, path, rev_path);
+
+    return make_conversation(dir, peer, path, rev_path, out);
+}
+
+/*
+ * Create name in parent and take the kernel's reference to it, or a plain
+ * one for put_node when e is NULL. Only the directories the new entries
+ * go into are locked: parent, and for a conversation the peer's, found
+ * under the bot index for reading.
+ */
+static int make_entry(fuse_ino_t parent, const char *name, uint64_t *lsn,
+                      struct fuse_entry_param *e, struct daidai_node **out) {
+    struct daidai_node *dir = node_of(parent), *peer = NULL;
+    char path[PATH_MAX];
+
+    if (view_of(parent))
+        return -EACCES;
+    if (dir->type != Directory)
+        return -ENOTDIR;
+    int res = reserved_name(dir, name);
+    if (res == 0)
+        res = child_path(dir, name, path, sizeof(path));
+    if (res != 0)
+        return res;
+
+    int talk = is_conversation(path);
+    struct daidai_node *first = dir, *second = NULL;
+    if (talk) {
+        pthread_rwlock_rdlock(root_node->lock);
+        peer = peer_dir(path);
+        if (peer != NULL && peer != dir) {
+            first = dir < peer ? dir : peer;
+            second = dir < peer ? peer : dir;
+        }
+    }
+    pthread_rwlock_wrlock(first->lock);
+    if (second != NULL)
+        pthread_rwlock_wrlock(second->lock);
+
+    res = dir->unlinked ? -ENOENT : 0;
+    if (res == 0)
+        res = make_path(dir, peer, path, out);
+    if (res == 0)
+        res = journal_append(JOURNAL_CREATE, path, NULL, 0, 0, lsn);
+    if (res == 0 && e != NULL)
+        fill_entry(e, *out, 0);
+    else if (res == 0) {
+        /* not made through the kernel, which may have it cached as missing */
+        __atomic_add_fetch(&(*out)->refs, 1, __ATOMIC_RELAXED);
+        queue_inval_entry(dir, name);
+    }
+
+    if (second != NULL)
+        pthread_rwlock_unlock(second->lock);
+    pthread_rwlock_unlock(first->lock);
+    if (talk)
+        pthread_rwlock_unlock(root_node->lock);
+
+    /* what the kernel makes shows up on the other node too; a delivery makes it there anyway */
+    char rev_path[PATH_MAX];
+    if (res == 0 && e != NULL && (*out)->type == File && (*out)->conv->shard >= 0 &&
+        reverse_path(path, rev_path, sizeof(rev_path)) == 0)
+        cluster_queue((*out)->conv->shard, JOURNAL_CREATE, rev_path, NULL);
+
+    return res;
+}
+
+/* apply one journal record, called before the session starts */
+static void replay_record(const struct journal_rec *rec, const char *path, const char *data) {
+    struct daidai_node *node;
+
+    switch (rec->type) {
+    case JOURNAL_MKDIR:
+        make_dir(parent_dir(path), path, &node);
+        break;
+    case JOURNAL_CREATE:
+        make_path(parent_dir(path), peer_dir(path), path, &node);
+        break;
+    case JOURNAL_WRITE:
+        node = find_node(path);
+        if (node != NULL && node->type == File &&
+            conv_write(node->conv, data, rec->data_len, rec->offset) == 0 && options.framed)
+            add_mark(node->conv, rec->offset + rec->data_len);
+        /* nothing runs in the background yet, keep to the budget here */
+        if (evict_over())
+            evict_some();
+        break;
+    case JOURNAL_DROP:
+        node = find_node(path);
+        if (node != NULL && node->type == File && rec->offset % CHUNK_SIZE == 0 &&
+            rec->offset > node->conv->start && rec->offset <= node->conv->size)
+            drop_front(node->conv, rec->offset);
+        break;
+    case JOURNAL_RETAIN:
+        node = find_node(path);
+        if (node != NULL && node->type == File && rec->data_len == sizeof(struct retention))
+            memcpy(&node->conv->retain, data, sizeof(struct retention));
+        break;
+    case JOURNAL_UNLINK:
+    case JOURNAL_RMDIR:
+        node = find_node(path);
+        if (node != NULL && node != root_node && node->type == Directory)
+            erase_tree(node);
+        else if (node != NULL && node != root_node) {
+            __atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+            erase_node(node);
+            if (is_group_path(node->path))
+                drop_peer(node);
+            put_node(node, 1);
+        }
+        break;
+    }
+}
+
+/*
+ * Replay one journal file and leave fd at its end. The file is mapped and
+ * walked once; the first record that is cut short or fails its checksum
+ * ends the replay and is truncated away.
+ */
+static int replay_file(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return -errno;
+
+    size_t size = st.st_size, pos = 0;
+    if (size > 0) {
+        char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+            return -errno;
+        madvise(map, size, MADV_SEQUENTIAL);
+
+        char path[PATH_MAX];
+        while (size - pos >= sizeof(struct journal_rec)) {
+            struct journal_rec rec;
+            memcpy(&rec, map + pos, sizeof(rec));
+            if (rec.path_len >= PATH_MAX)
+                break;
+            size_t len = sizeof(rec) + rec.path_len + (size_t) rec.data_len;
+            if (len > size - pos)
+                break;
+            if (journal_sum(2166136261u, map + pos + sizeof(rec.sum), len - sizeof(rec.sum)) != rec.sum)
+                break;
+
+            memcpy(path, map + pos + sizeof(rec), rec.path_len);
+            path[rec.path_len] = '\0';
+            replay_record(&rec, path, map + pos + sizeof(rec) + rec.path_len);
+            pos += len;
+        }
+        munmap(map, size);
+    }
+    if (pos < size) {
+        fprintf(stderr, "journal: dropping %zu bytes of torn tail\n", size - pos);
+        if (ftruncate(fd, pos) != 0)
+            return -errno;
+    }
+
+    return 0;
+}
+
+/*
+ * Rebuild the tree from DIR: the snapshot first, then every journal
+ * generation from the one it names on. The last one stays open for
+ * appending.
+ */
+static int load_state(const char *dir) {
+    uint64_t gen;
+    char path[PATH_MAX];
+
+    journal.dir = dir;
+    int res = load_snapshot(dir, &gen);
+    if (res != 0)
+        return res;
+    /* left behind if we crashed between the rename and the cleanup */
+    if (gen > 1 && journal_path(path, sizeof(path), gen - 1) == 0)
+        unlink(path);
+
+    int fd = -1;
+    for (;; gen++) {
+        res = journal_path(path, sizeof(path), gen);
+        if (res != 0)
+            break;
+        int next = open(path, O_RDWR | O_APPEND | (fd < 0 ? O_CREAT : 0), 0644);
+        if (next < 0 && fd >= 0 && errno == ENOENT)
+            break;
+        if (next < 0) {
+            res = -errno;
+            break;
+        }
+        if (fd >= 0)
+            close(fd);
+        fd = next;
+        res = replay_file(fd);
+        if (res != 0)
+            break;
+    }
+    if (res != 0) {
+        if (fd >= 0)
+            close(fd);
+        return res;
+    }
+
+    journal.fd = fd;
+    journal.gen = gen - 1;
+    journal.on = 1;
+    return 0;
+}
+
+static void daidai_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                         dev_t rdev) {
+    traceLog(TRACE_MKNOD, name);
+
+    (void) rdev;
+
+    struct fuse_entry_param e;
+    struct daidai_node *node;
+    uint64_t lsn = 0;
+    int res = S_ISREG(mode) ? 0 : -EPERM;
+
+    if (res == 0)
+        res = make_entry(parent, name, &lsn, &e, &node);
+
+    if (res == 0 && (res = journal_sync(lsn)) != 0)
+        forget_node(node, 1);
+    if (res != 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_entry(req, &e);
+}
+
+static void daidai_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                          struct fuse_file_info *fi) {
+    traceLog(TRACE_CREATE, name);
+
+    (void) mode;
+
+    struct fuse_entry_param e;
+    struct daidai_node *node;
+    uint64_t lsn = 0;
+
+    int res = make_entry(parent, name, &lsn, &e, &node);
+    if (res == 0 && (res = open_node(node, 0, fi)) != 0)
+        forget_node(node, 1);
+    else if (res == 0 && (res = journal_sync(lsn)) != 0) {
+        close_handle(handle_of(fi));
+        forget_node(node, 1);
+    }
+    if (res != 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_create(req, &e, fi);
+}
+
+static void daidai_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    traceLog(TRACE_UNLINK, name);
+
+    fuse_reply_err(req, -remove_entry(parent, name, 0));
+}
+
+/*
+ * Batched ingestion (/.batch)
+ *
+ * One write carries any number of records, each a header line
+ * "<sender> <recipient> <length>\n" and then length bytes of message,
+ * appended to /sender/recipient, which is made when it is missing. A
+ * record cut short at the end of a write is completed by the next one.
+ *
+ * The records of a write are resolved first, then applied conversation
+ * by conversation under one lock acquisition each, in the order they were
+ * written, and the write waits for a single journal sync. Reading the
+ * handle returns a line per record written through it, each once:
+ * "<n>\t<sender>/<recipient>\t<0 or -errno>".
+ */
+#define BATCH_HEADER_MAX (2 * NAME_MAX + 24)
+#define BATCH_RECORD_MAX (16 << 20)
+
+struct batch_state {
+    size_t nr_records;              /* so far on this handle */
+    size_t carry_len, carry_max;
+    char carry[];                   /* the start of a record still coming */
+};
+
+struct batch_rec {
+    const char *from, *to, *data;
+    size_t from_len, to_len, len;
+    struct conversation *conv;      /* pinned */
+    int res;
+};
+
+static int batch_name(const char *name, size_t len) {
+    if (len == 0 || len > NAME_MAX || memchr(name, '/', len) != NULL)
+        return 0;
+    return !(name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.')));
+}
+
+/* 1 with rec, 0 when buf does not hold a whole record yet, or -EINVAL */
+static int batch_parse(const char *buf, size_t size, struct batch_rec *rec, size_t *used) {
+    const char *end = memchr(buf, '\n', size < BATCH_HEADER_MAX ? size : BATCH_HEADER_MAX);
+    if (end == NULL)
+        return size < BATCH_HEADER_MAX ? 0 : -EINVAL;
+
+    const char *to = memchr(buf, ' ', end - buf);
+    const char *len = to ? memchr(to + 1, ' ', end - to - 1) : NULL;
+    if (len == NULL || len + 1 == end)
+        return -EINVAL;
+    rec->from = buf;
+    rec->from_len = to - buf;
+    rec->to = to + 1;
+    rec->to_len = len - to - 1;
+    rec->len = 0;
+    for (const char *digit = len + 1; digit < end; digit++) {
+        if (*digit < '0' || *digit > '9' || rec->len > BATCH_RECORD_MAX)
+            return -EINVAL;
+        rec->len = rec->len * 10 + (*digit - '0');
+    }
+    if (!batch_name(rec->from, rec->from_len) || !batch_name(rec->to, rec->to_len) ||
+        rec->len > BATCH_RECORD_MAX)
+        return -EINVAL;
+
+    size_t header = end + 1 - buf;
+    if (size - header < rec->len)
+        return 0;
+    rec->data = end + 1;
+    rec->conv = NULL;
+    rec->res = 0;
+    *used = header + rec->len;
+    return 1;
+}
+
+/* pin the conversation of /from/to, making it when it is missing */
+static int batch_resolve(struct batch_rec *rec, uint64_t *lsn) {
+    char from[NAME_MAX + 1], to[NAME_MAX + 1];
+
+    memcpy(from, rec->from, rec->from_len);
+    from[rec->from_len] = '\0';
+    memcpy(to, rec->to, rec->to_len);
+    to[rec->to_len] = '\0';
+
+    for (int tries = 0; tries < 2; tries++) {
+        pthread_rwlock_rdlock(root_node->lock);
+        struct daidai_node *dir = find_child(root_node, from), *node = NULL;
+        if (dir != NULL && dir->type == Directory) {
+            pthread_rwlock_rdlock(dir->lock);
+            node = find_child(dir, to);
+            if (node != NULL && node->type == File)
+                rec->conv = get_conv(node->conv);
+            pthread_rwlock_unlock(dir->lock);
+            /* make_entry takes the bot index again, keep dir meanwhile */
+            if (node == NULL)
+                __atomic_add_fetch(&dir->refs, 1, __ATOMIC_RELAXED);
+        }
+        pthread_rwlock_unlock(root_node->lock);
+
+        if (dir == NULL || dir->type != Directory)
+            return -ENOENT;
+        if (node != NULL)
+            return rec->conv ? 0 : -EISDIR;
+
+        uint64_t entry_lsn = 0;
+        int res = make_entry(ino_of(dir), to, &entry_lsn, NULL, &node);
+        put_node(dir, 1);
+        if (res == -EEXIST)
+            continue;
+        if (res != 0)
+            return res;
+        rec->conv = get_conv(node->conv);
+        put_node(node, 1);
+        if (entry_lsn > *lsn)
+            *lsn = entry_lsn;
+        return 0;
+    }
+    return -EEXIST;
+}
+
+/* order of application: by conversation, then as written */
+static int batch_cmp(const void *a, const void *b) {
+    const struct batch_rec *x = *(const struct batch_rec **) a, *y = *(const struct batch_rec **) b;
+
+    if (x->conv != y->conv)
+        return (uintptr_t) x->conv < (uintptr_t) y->conv ? -1 : 1;
+    return x < y ? -1 : x > y;
+}
+
+/* forward is 0 for what another node delivered, which goes no further */
+static int batch_apply(struct batch_rec *recs, size_t nr_recs, uint64_t *lsn, int forward) {
+    struct batch_rec **order = xmalloc((nr_recs ? nr_recs : 1) * sizeof(struct batch_rec *));
+    if (order == NULL)
+        return -ENOMEM;
+    for (size_t i = 0; i < nr_recs; i++)
+        order[i] = &recs[i];
+    qsort(order, nr_recs, sizeof(struct batch_rec *), batch_cmp);
+
+    int journaled = journal_on();
+    for (size_t i = 0; i < nr_recs;) {
+        struct conversation *conv = order[i]->conv;
+        size_t group = i;
+        while (group < nr_recs && order[group]->conv == conv)
+            group++;
+        if (conv == NULL) {
+            i = group;
+            continue;
+        }
+
+        /* one claim for the whole group, copied outside the lock */
+        struct append app;
+        size_t total = 0;
+        for (size_t j = i; j < group; j++)
+            total += order[j]->len;
+        if (forward)
+            cluster_wait_room(conv->shard);
+        touch_conv(conv);
+        pthread_rwlock_wrlock(&conv->lock);
+        int res = claim_append(conv, total, &app);
+        pthread_rwlock_unlock(&conv->lock);
+        if (res != 0) {
+            for (; i < group; i++)
+                order[i]->res = res;
+            continue;
+        }
+        size_t pos = 0;
+        for (size_t j = i; j < group; j++) {
+            fill_append(&app, pos, order[j]->data, order[j]->len);
+            pos += order[j]->len;
+        }
+
+        publish_wait(conv, &app);
+        for (pos = 0; i < group; i++) {
+            struct batch_rec *rec = order[i];
+            uint64_t rec_lsn = 0;
+
+            rec->res = 0;
+            if (journaled && conv->ends != NULL)
+                rec->res = journal_append(JOURNAL_WRITE, conv->ends->path, rec->data, rec->len,
+                                          app.offset + pos, &rec_lsn);
+            if (rec->res == 0 && forward && conv->shard >= 0 && conv->ends != NULL) {
+                struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(rec->len);
+                bufv.buf[0].mem = (void *) rec->data;
+                rec->res = forward_write(conv, &bufv);
+            }
+            if (rec_lsn > *lsn)
+                *lsn = rec_lsn;
+            pos += rec->len;
+            if (options.framed && rec->res == 0)
+                rec->res = add_mark(conv, app.offset + pos);
+        }
+        publish_append(conv, &app);
+        retain_conv(conv);
+        struct waiter *waiters = take_waiters(conv);
+        pthread_rwlock_unlock(&conv->lock);
+        wake_waiters(waiters);
+        queue_inval(conv);
+    }
+    xfree(order);
+
+    return 0;
+}
+
+/* append the status lines of recs to *vbuf, dropping what was read */
+static int batch_status(struct vfile_buf **vbuf, struct batch_state *state,
+                        const struct batch_rec *recs, size_t nr_recs) {
+    struct vfile_buf *in = *vbuf;
+    memmove(in->data, in->data + in->read, in->size - in->read);
+    in->size -= in->read;
+    in->read = 0;
+
+    size_t need = 0;
+    for (size_t i = 0; i < nr_recs; i++)
+        need += recs[i].from_len + recs[i].to_len + 48;
+
+    struct vfile_buf *out = xrealloc(*vbuf, sizeof(struct vfile_buf) + (*vbuf)->size + need);
+    if (out == NULL)
+        return -ENOMEM;
+    for (size_t i = 0; i < nr_recs; i++)
+        out->size += sprintf(out->data + out->size, "%zu\t%.*s/%.*s\t%d\n", state->nr_records++,
+                             (int) recs[i].from_len, recs[i].from, (int) recs[i].to_len, recs[i].to,
+                             recs[i].res);
+    *vbuf = out;
+
+    return 0;
+}
+
+static struct vfile_buf *renderBatch(void) {
+    struct vfile_buf *out = xmalloc(sizeof(struct vfile_buf));
+    if (out != NULL)
+        out->size = 0;
+
+    return out;
+}
+
+/* room for need bytes of carry */
+static struct batch_state *batch_reserve(struct vfile_buf *vbuf, size_t need) {
+    struct batch_state *state = vbuf->priv;
+    if (state != NULL && need <= state->carry_max)
+        return state;
+
+    size_t max = state ? state->carry_max : 0;
+    while (max < need)
+        max = max ? max * 2 : 4096;
+    struct batch_state *grown = xrealloc(state, sizeof(struct batch_state) + max);
+    if (grown == NULL)
+        return NULL;
+    if (state == NULL)
+        grown->nr_records = grown->carry_len = 0;
+    grown->carry_max = max;
+    vbuf->priv = grown;
+    return grown;
+}
+
+static int writeBatch(struct vfile_buf **vbuf, const char *buf, size_t size) {
+    struct batch_state *state = (*vbuf)->priv;
+    const char *data = buf;
+    size_t len = size;
+
+    /* a record left over from the last write is completed in the carry */
+    if (state == NULL || state->carry_len > 0) {
+        state = batch_reserve(*vbuf, (state ? state->carry_len : 0) + size);
+        if (state == NULL)
+            return -ENOMEM;
+    }
+    if (state->carry_len > 0) {
+        memcpy(state->carry + state->carry_len, buf, size);
+        data = state->carry;
+        len = state->carry_len + size;
+    }
+
+    struct batch_rec *recs = NULL;
+    size_t nr_recs = 0, max_recs = 0, pos = 0, used;
+    int res = 0;
+    for (;;) {
+        if (nr_recs == max_recs) {
+            size_t max = max_recs ? max_recs * 2 : 64;
+            struct batch_rec *grown = xrealloc(recs, max * sizeof(struct batch_rec));
+            if (grown == NULL) {
+                res = -ENOMEM;
+                break;
+            }
+            recs = grown;
+            max_recs = max;
+        }
+        int parsed = batch_parse(data + pos, len - pos, &recs[nr_recs], &used);
+        if (parsed <= 0) {
+            res = parsed;
+            break;
+        }
+        nr_recs++;
+        pos += used;
+    }
+
+    uint64_t lsn = 0;
+    for (size_t i = 0; i < nr_recs; i++) {
+        struct batch_rec *rec = &recs[i], *prev = i ? &recs[i - 1] : NULL;
+        /* bursts often repeat a pair, resolve it once */
+        if (prev != NULL && prev->conv != NULL && prev->from_len == rec->from_len &&
+            prev->to_len == rec->to_len && memcmp(prev->from, rec->from, rec->from_len) == 0 &&
+            memcmp(prev->to, rec->to, rec->to_len) == 0)
+            rec->conv = get_conv(prev->conv);
+        else
+            rec->res = batch_resolve(rec, &lsn);
+    }
+    int failed = batch_apply(recs, nr_recs, &lsn, 1);
+    if (failed == 0)
+        failed = journal_sync(lsn);
+    for (size_t i = 0; i < nr_recs; i++) {
+        if (recs[i].res == 0)
+            recs[i].res = failed;
+        if (recs[i].conv != NULL)
+            put_conv(recs[i].conv);
+    }
+    int listed = batch_status(vbuf, state, recs, nr_recs);
+    if (res == 0)
+        res = listed;
+    xfree(recs);
+
+    /* keep the start of a record for the next write */
+    state->carry_len = 0;
+    if (res == 0 && pos < len) {
+        if (data == buf && (state = batch_reserve(*vbuf, len - pos)) == NULL)
+            return -ENOMEM;
+        memmove(state->carry, data + pos, len - pos);
+        state->carry_len = len - pos;
+    }
+
+    return res ? res : (int) size;
+}
+
+static const struct vfile_ops batch_file_ops = {
+        .render = renderBatch,
+        .write  = writeBatch,
+        .stream = 1,
+};
+
+/*
+ * Receiving from the other nodes (-o cluster)
+ *
+ * A thread per connection checks the records like replay does and
+ * applies the ones it has not seen, as one batch per read: writes go
+ * through batch_apply, which makes the conversations missing here, and
+ * unlinks through remove_entry. One journal sync covers the batch, then
+ * the number of its last record goes back.
+ */
+#define CLUSTER_READ (256 * 1024)
+
+struct cluster_conn {
+    int fd;                         /* -1 once done, under cluster.lock */
+    pthread_t thread;
+    struct cluster_conn *next;
+};
+
+/* the writes in recs, applied and released; a create only resolves */
+static void cluster_flush(struct batch_rec *recs, size_t nr_recs, uint64_t *lsn) {
+    for (size_t i = 0; i < nr_recs; i++)
+        if ((recs[i].res = batch_resolve(&recs[i], lsn)) == 0 && recs[i].len == 0) {
+            put_conv(recs[i].conv);
+            recs[i].conv = NULL;
+        }
+    batch_apply(recs, nr_recs, lsn, 0);
+    for (size_t i = 0; i < nr_recs; i++)
+        if (recs[i].conv != NULL)
+            put_conv(recs[i].conv);
+}
+
+/* unlink path, a conversation whose other end went with its bot */
+static void cluster_unlink(const char *path) {
+    char bot[NAME_MAX + 1];
+    const char *sep = strchr(path + 1, '/');
+
+    memcpy(bot, path + 1, sep - path - 1);
+    bot[sep - path - 1] = '\0';
+    pthread_rwlock_rdlock(root_node->lock);
+    struct daidai_node *dir = find_child(root_node, bot);
+    if (dir != NULL && dir->type == Directory)
+        __atomic_add_fetch(&dir->refs, 1, __ATOMIC_RELAXED);
+    else
+        dir = NULL;
+    pthread_rwlock_unlock(root_node->lock);
+
+    if (dir != NULL) {
+        if (remove_entry(ino_of(dir), sep + 1, 0) == 0)
+            queue_inval_entry(dir, sep + 1);
+        put_node(dir, 1);
+    }
+}
+
+/*
+ * Apply the whole records in buf, the ones past *applied, and return how
+ * many bytes they took, or -EPROTO at a record that does not check out.
+ */
+static ssize_t cluster_apply(const char *buf, size_t len, uint64_t *applied, uint64_t *lsn) {
+    struct batch_rec *recs = NULL;
+    size_t nr_recs = 0, max_recs = 0, pos = 0;
+    char path[PATH_MAX];
+    ssize_t res = 0;
+
+    while (len - pos >= sizeof(struct journal_rec)) {
+        struct journal_rec rec;
+        memcpy(&rec, buf + pos, sizeof(rec));
+        const char *name = buf + pos + sizeof(rec), *data = name + rec.path_len;
+        if (rec.path_len >= PATH_MAX || rec.data_len > BATCH_RECORD_MAX) {
+            res = -EPROTO;
+            break;
+        }
+        if (len - pos - sizeof(rec) < rec.path_len + rec.data_len)
+            break;
+        uint32_t sum = journal_sum(2166136261u, &rec.type, sizeof(rec) - sizeof(rec.sum));
+        sum = journal_sum(sum, name, rec.path_len);
+        sum = journal_sum(sum, data, rec.data_len);
+        memcpy(path, name, rec.path_len);
+        path[rec.path_len] = '\0';
+        const char *sep = path[0] == '/' ? strchr(path + 1, '/') : NULL;
+        if (sum != rec.sum || sep == NULL || !batch_name(path + 1, sep - path - 1) ||
+            !batch_name(sep + 1, strlen(sep + 1)) || remote_node(path) >= 0) {
+            res = -EPROTO;
+            break;
+        }
+        pos += sizeof(rec) + rec.path_len + rec.data_len;
+        if (rec.offset <= *applied)
+            continue;
+        *applied = rec.offset;
+
+        if (rec.type == JOURNAL_UNLINK) {
+            /* what came before it goes first */
+            cluster_flush(recs, nr_recs, lsn);
+            nr_recs = 0;
+            cluster_unlink(path);
+            continue;
+        }
+        if (rec.type != JOURNAL_CREATE && rec.type != JOURNAL_WRITE)
+            continue;
+        if (nr_recs == max_recs) {
+            size_t max = max_recs ? max_recs * 2 : 64;
+            struct batch_rec *grown = xrealloc(recs, max * sizeof(struct batch_rec));
+            if (grown == NULL) {
+                res = -ENOMEM;
+                break;
+            }
+            recs = grown;
+            max_recs = max;
+        }
+        recs[nr_recs++] = (struct batch_rec) {
+                .from = name + 1,
+                .from_len = sep - path - 1,
+                .to = name + (sep + 1 - path),
+                .to_len = strlen(sep + 1),
+                .data = data,
+                .len = rec.data_len,
+        };
+    }
+    cluster_flush(recs, nr_recs, lsn);
+    xfree(recs);
+
+    return res ? res : (ssize_t) pos;
+}
+
+static void *cluster_receiver(void *arg) {
+    struct cluster_conn *conn = arg;
+    struct cluster_hello hello;
+    char *buf = NULL;
+    size_t len = 0, max = 0;
+
+    if (read_all(conn->fd, &hello, sizeof(hello)) != 0 ||
+        memcmp(hello.magic, CLUSTER_MAGIC, sizeof(hello.magic)) != 0 ||
+        hello.node >= cluster.nr_nodes || hello.node == cluster.self)
+        goto out;
+
+    /* a node that started over numbers from 1 again */
+    pthread_mutex_lock(&cluster.from[hello.node].lock);
+    if (cluster.from[hello.node].boot != hello.boot) {
+        cluster.from[hello.node].boot = hello.boot;
+        cluster.from[hello.node].applied = 0;
+    }
+    uint64_t applied = cluster.from[hello.node].applied;
+    pthread_mutex_unlock(&cluster.from[hello.node].lock);
+    if (write_all(conn->fd, (const char *) &applied, sizeof(applied)) != 0)
+        goto out;
+
+    for (;;) {
+        if (max - len < CLUSTER_READ) {
+            char *grown = xrealloc(buf, max + CLUSTER_READ);
+            if (grown == NULL)
+                break;
+            buf = grown;
+            max += CLUSTER_READ;
+        }
+        ssize_t got = read(conn->fd, buf + len, max - len);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+        len += got;
+
+        /* an older connection of the same node may still be applying */
+        uint64_t lsn = 0;
+        pthread_mutex_lock(&cluster.from[hello.node].lock);
+        if (cluster.from[hello.node].boot != hello.boot) {
+            pthread_mutex_unlock(&cluster.from[hello.node].lock);
+            break;
+        }
+        ssize_t used = cluster_apply(buf, len, &cluster.from[hello.node].applied, &lsn);
+        applied = cluster.from[hello.node].applied;
+        pthread_mutex_unlock(&cluster.from[hello.node].lock);
+        if (used < 0)
+            break;
+        memmove(buf, buf + used, len - used);
+        len -= used;
+        if (used > 0 && (journal_sync(lsn) != 0 ||
+                         write_all(conn->fd, (const char *) &applied, sizeof(applied)) != 0))
+            break;
     }
 
-    ret = fuse_main(args.argc, args.argv, &daidai_oper, NULL);
+out:
+    xfree(buf);
+    pthread_mutex_lock(&cluster.lock);
+    close(conn->fd);
+    conn->fd = -1;
+    pthread_mutex_unlock(&cluster.lock);
+
+    return NULL;
+}
+
+/* accept the other nodes' connections, joining the threads of the ones that ended */
+static void *cluster_listener(void *arg) {
+    (void) arg;
+
+    for (;;) {
+        /* until cluster_stop shuts the socket down */
+        int fd = accept(cluster.listen_fd, NULL, NULL);
+        if (fd < 0 && (errno == EINTR || errno == ECONNABORTED))
+            continue;
+        if (fd < 0)
+            break;
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        pthread_mutex_lock(&cluster.lock);
+        for (struct cluster_conn **pos = &cluster.conns; *pos != NULL;) {
+            struct cluster_conn *done = *pos;
+            if (done->fd >= 0) {
+                pos = &done->next;
+                continue;
+            }
+            *pos = done->next;
+            pthread_join(done->thread, NULL);
+            xfree(done);
+        }
+        struct cluster_conn *conn = xmalloc(sizeof(struct cluster_conn));
+        if (conn != NULL) {
+            conn->fd = fd;
+            if (pthread_create(&conn->thread, NULL, cluster_receiver, conn) == 0) {
+                conn->next = cluster.conns;
+                cluster.conns = conn;
+            } else {
+                xfree(conn);
+                conn = NULL;
+            }
+        }
+        if (conn == NULL)
+            close(fd);
+        pthread_mutex_unlock(&cluster.lock);
+    }
+
+    return NULL;
+}
+
+/* read the node list: "host port" lines, blank ones and '#' comments skipped */
+static int cluster_load(const char *file, unsigned int self) {
+    char line[1024];
+    FILE *in = fopen(file, "r");
+    if (in == NULL)
+        return -errno;
+
+    int res = 0;
+    while (res == 0 && fgets(line, sizeof(line), in) != NULL) {
+        char host[512], port[32], rest;
+        int fields = sscanf(line, " %511s %31s %c", host, port, &rest);
+        if (fields <= 0 || host[0] == '#')
+            continue;
+        if (fields != 2 || cluster.nr_nodes == CLUSTER_NODES_MAX) {
+            res = -EINVAL;
+            break;
+        }
+        struct cluster_link *link = &cluster.links[cluster.nr_nodes++];
+        link->host = strdup(host);
+        link->port = strdup(port);
+        if (link->host == NULL || link->port == NULL)
+            res = -ENOMEM;
+    }
+    fclose(in);
+    if (res == 0 && self >= cluster.nr_nodes)
+        res = -EINVAL;
+    if (res != 0)
+        return res;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    cluster.self = self;
+    cluster.boot = ((uint64_t) now.tv_sec * 1000000000 + now.tv_nsec) ^ getpid();
+    for (size_t i = 0; i < cluster.nr_nodes; i++) {
+        pthread_mutex_init(&cluster.links[i].lock, NULL);
+        pthread_cond_init(&cluster.links[i].wake, NULL);
+        pthread_cond_init(&cluster.links[i].room, NULL);
+        cluster.links[i].fd = -1;
+        pthread_mutex_init(&cluster.from[i].lock, NULL);
+    }
+
+    return 0;
+}
+
+/* listen on this node's line and start a sender for each of the others; a failure leaves nothing behind */
+static int cluster_start(void) {
+    struct cluster_link *self = &cluster.links[cluster.self];
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE}, *res, *ai;
+    int one = 1;
+
+    if (getaddrinfo(self->host, self->port, &hints, &res) != 0)
+        return -EADDRNOTAVAIL;
+    for (ai = res; ai != NULL && cluster.listen_fd < 0; ai = ai->ai_next) {
+        int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0)
+            cluster.listen_fd = fd;
+        else
+            close(fd);
+    }
+    freeaddrinfo(res);
+    if (cluster.listen_fd < 0)
+        return -EADDRINUSE;
+    cluster.listening = pthread_create(&cluster.thread, NULL, cluster_listener, NULL) == 0;
+    if (!cluster.listening) {
+        close(cluster.listen_fd);
+        cluster.listen_fd = -1;
+        return -EAGAIN;
+    }
+
+    cluster.on = 1;
+    for (size_t i = 0; i < cluster.nr_nodes; i++)
+        if (i != cluster.self)
+            cluster.links[i].running =
+                    pthread_create(&cluster.links[i].thread, NULL, cluster_sender, &cluster.links[i]) == 0;
+
+    return 0;
+}
+
+static void cluster_stop(void) {
+    for (size_t i = 0; i < cluster.nr_nodes; i++) {
+        struct cluster_link *link = &cluster.links[i];
+        if (!link->running)
+            continue;
+        pthread_mutex_lock(&link->lock);
+        link->stop = 1;
+        pthread_cond_broadcast(&link->wake);
+        pthread_cond_broadcast(&link->room);
+        if (link->fd >= 0)
+            shutdown(link->fd, SHUT_RDWR);
+        pthread_mutex_unlock(&link->lock);
+        pthread_join(link->thread, NULL);
+        link->running = 0;
+    }
+    if (cluster.listening) {
+        shutdown(cluster.listen_fd, SHUT_RDWR);
+        pthread_join(cluster.thread, NULL);
+        cluster.listening = 0;
+    }
+    if (cluster.listen_fd >= 0)
+        close(cluster.listen_fd);
+    cluster.listen_fd = -1;
+
+    pthread_mutex_lock(&cluster.lock);
+    for (struct cluster_conn *conn = cluster.conns; conn != NULL; conn = conn->next)
+        if (conn->fd >= 0)
+            shutdown(conn->fd, SHUT_RDWR);
+    pthread_mutex_unlock(&cluster.lock);
+    while (cluster.conns != NULL) {
+        struct cluster_conn *conn = cluster.conns;
+        cluster.conns = conn->next;
+        pthread_join(conn->thread, NULL);
+        xfree(conn);
+    }
+}
+
+/* the callbacks as the session calls them, timed for /.stats */
+static void timed_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    timed(TRACE_LOOKUP, daidai_lookup(req, parent, name));
+}
+
+static void timed_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    timed(TRACE_FORGET, daidai_forget(req, ino, nlookup));
+}
+
+static void timed_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+    timed(TRACE_FORGET, daidai_forget_multi(req, count, forgets));
+}
+
+static void timed_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    timed(TRACE_GETATTR, daidai_getattr(req, ino, fi));
+}
+
+static void timed_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+                          struct fuse_file_info *fi) {
+    timed(TRACE_SETATTR, daidai_setattr(req, ino, attr, to_set, fi));
+}
+
+static void timed_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    timed(TRACE_OPEN, daidai_open(req, ino, fi));
+}
+
+static void timed_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                       struct fuse_file_info *fi) {
+    timed(TRACE_READ, daidai_read(req, ino, size, offset, fi));
+}
+
+static void timed_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+                            off_t offset, struct fuse_file_info *fi) {
+    timed(TRACE_WRITE, daidai_write_buf(req, ino, bufv, offset, fi));
+}
+
+static void timed_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    timed(TRACE_RELEASE, daidai_release(req, ino, fi));
+}
+
+static void timed_poll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi,
+                       struct fuse_pollhandle *ph) {
+    timed(TRACE_POLL, daidai_poll(req, ino, fi, ph));
+}
+
+static void timed_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    timed(TRACE_MKDIR, daidai_mkdir(req, parent, name, mode));
+}
+
+static void timed_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    timed(TRACE_RMDIR, daidai_rmdir(req, parent, name));
+}
+
+static void timed_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    timed(TRACE_OPENDIR, daidai_opendir(req, ino, fi));
+}
+
+static void timed_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                          struct fuse_file_info *fi) {
+    timed(TRACE_READDIR, daidai_readdir(req, ino, size, offset, fi));
+}
+
+static void timed_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    timed(TRACE_RELEASEDIR, daidai_releasedir(req, ino, fi));
+}
+
+static void timed_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                        dev_t rdev) {
+    timed(TRACE_MKNOD, daidai_mknod(req, parent, name, mode, rdev));
+}
+
+static void timed_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                         struct fuse_file_info *fi) {
+    timed(TRACE_CREATE, daidai_create(req, parent, name, mode, fi));
+}
+
+static void timed_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    timed(TRACE_UNLINK, daidai_unlink(req, parent, name));
+}
+
+static const struct fuse_lowlevel_ops daidai_oper = {
+        .init           = daidai_init,
+        .destroy        = daidai_destroy,
+        .lookup         = timed_lookup,
+        .forget         = timed_forget,
+        .forget_multi   = timed_forget_multi,
+        .getattr        = timed_getattr,
+        .setattr        = timed_setattr,
+        .open           = timed_open,
+        .read           = timed_read,
+        .write_buf      = timed_write_buf,
+        .release        = timed_release,
+        .poll           = timed_poll,
+        .mkdir          = timed_mkdir,
+        .rmdir          = timed_rmdir,
+        .opendir        = timed_opendir,
+        .readdir        = timed_readdir,
+        .releasedir     = timed_releasedir,
+        .mknod          = timed_mknod,
+        .create         = timed_create,
+        .unlink         = timed_unlink,
+};
+
+
+static void show_help(const char *progname) {
+    printf("usage: %s [options] <mountpoint>\n\n", progname);
+    printf("File-system specific options:\n"
+           "    -o log_lines=N         lines kept in /log_file (default: %d)\n"
+           "    -o trace=LIST          operations to trace, e.g. all or read,write\n"
+           "    -o cache               let the kernel cache pages, attributes and entries\n"
+           "    -o cache_timeout=N     attribute and entry timeout in seconds (default: %d)\n"
+           "    -o journal=DIR         keep the chats in DIR across mounts\n"
+           "    -o compact=N           snapshot DIR after N MiB of journal, 0 never (default: %d)\n"
+           "    -o max_memory=N        MiB of chat content kept in memory, the rest is\n"
+           "                           spilled to DIR or $TMPDIR (default: no limit)\n"
+           "    -o blocking_read       a read at the end of a chat waits for the next message\n"
+           "    -o splice              copy written messages straight from the kernel's pipe\n"
+           "    -o framed              index the messages, a/b.tail/N shows the last N of a/b\n"
+           "    -o retain_size=N       keep about the last N MiB of each chat (default: all)\n"
+           "    -o retain_messages=N   keep about the last N messages, needs framed\n"
+           "    -o retain_age=N        drop what is older than N seconds\n"
+           "    -o cluster=FILE        share the bots with the nodes listed in FILE\n"
+           "    -o node=N              this node's line in FILE, from 0 (default: 0)\n"
+           "\n", LOG_LINES_DEFAULT, CACHE_TIMEOUT_DEFAULT, COMPACT_DEFAULT);
+}
+
+static void add_virtual(const char *path, const struct vfile_ops *vops) {
+    struct daidai_node *node = create_node(Virtual, path, NULL);
+    node->vops = vops;
+    insert_node(root_node, node);
+}
+
+
+#ifndef DAIDAI_NO_MAIN
+int main(int argc, char *argv[]) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts opts;
+    struct fuse_session *se;
+    int ret = 1;
+
+    /* Parse options */
+    options.log_lines = LOG_LINES_DEFAULT;
+    options.cache_timeout = CACHE_TIMEOUT_DEFAULT;
+    options.compact = COMPACT_DEFAULT;
+    if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
+        return 1;
+    if (fuse_parse_cmdline(&args, &opts) != 0)
+        return 1;
+
+    if (opts.show_help) {
+        show_help(argv[0]);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        ret = 0;
+        goto out;
+    } else if (opts.show_version) {
+        fuse_lowlevel_version();
+        ret = 0;
+        goto out;
+    }
+    if (opts.mountpoint == NULL) {
+        printf("usage: %s [options] <mountpoint>\n", argv[0]);
+        printf("       %s --help\n", argv[0]);
+        goto out;
+    }
+
+    /* initialize */
+    root_node = create_node(Directory, "/", NULL);
+
+    initLog(options.log_lines);
+    if (options.trace != NULL)
+        trace_mask = parse_trace(options.trace, 0);
+    add_virtual("/log_file", &log_file_ops);
+    add_virtual("/.trace", &trace_file_ops);
+    add_virtual("/.alloc", &alloc_file_ops);
+    add_virtual("/.batch", &batch_file_ops);
+    add_virtual("/.stats", &stats_file_ops);
+    add_virtual("/.retain", &retain_file_ops);
+    if (options.retain_messages && !options.framed) {
+        fprintf(stderr, "%s: retain_messages needs -o framed\n", argv[0]);
+        goto out;
+    }
+    retain_mount.size = (uint64_t) options.retain_size << 20;
+    retain_mount.messages = options.retain_messages;
+    retain_mount.age = options.retain_age;
+    if (options.max_memory) {
+        const char *dir = options.journal ? options.journal : getenv("TMPDIR");
+        int res = init_spill(dir ? dir : "/tmp", (size_t) options.max_memory << 20);
+        if (res != 0) {
+            fprintf(stderr, "%s: spill file: %s\n", argv[0], strerror(-res));
+            goto out;
+        }
+    }
+    /* replay already needs to know which bots live elsewhere */
+    if (options.cluster != NULL) {
+        int res = cluster_load(options.cluster, options.node);
+        if (res != 0) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], options.cluster, strerror(-res));
+            goto out;
+        }
+    }
+    if (options.journal != NULL) {
+        int res = load_state(options.journal);
+        if (res != 0) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], options.journal, strerror(-res));
+            goto out;
+        }
+        compact.threshold = (uint64_t) options.compact << 20;
+    }
+
+    se = fuse_session_new(&args, &daidai_oper, sizeof(daidai_oper), NULL);
+    if (se == NULL)
+        goto out;
+    if (fuse_set_signal_handlers(se) != 0)
+        goto out_destroy;
+    if (fuse_session_mount(se, opts.mountpoint) != 0)
+        goto out_signals;
+
+    fuse_daemonize(opts.foreground);
+    session = se;
+    if (cluster.nr_nodes) {
+        int res = cluster_start();
+        if (res != 0) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], options.cluster, strerror(-res));
+            goto out_unmount;
+        }
+    }
+
+    /* callbacks may run on several threads, see the locking of root_node */
+    if (opts.singlethread)
+        ret = fuse_session_loop(se);
+    else
+        ret = fuse_session_loop_mt(se, opts.clone_fd);
+    cluster_stop();
+
+out_unmount:
+    fuse_session_unmount(se);
+out_signals:
+    fuse_remove_signal_handlers(se);
+out_destroy:
+    fuse_session_destroy(se);
+out:
+    if (journal_on())
+        close(journal.fd);
+    free(opts.mountpoint);
     fuse_opt_free_args(&args);
-    return ret;
-}
\ No newline at end of file
+
+    return ret ? 1 : 0;
+}
+#endif